@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// fixed size block pool, blocks are carved from large slabs and recycled through a free list.
+// memory is only returned to the system when the pool is destroyed.
+class SlabPool
+{
+private:
+	struct FreeBlock
+	{
+		FreeBlock *next;
+	};
+
+	static constexpr size_t Slab_Align = 64; // cache line
+
+	size_t block_size;
+	size_t slab_size;
+	std::vector<void *> slabs;
+	char *cur{nullptr};
+	char *end{nullptr};
+	FreeBlock *free_list{nullptr};
+
+public:
+	SlabPool(size_t block_size, size_t slab_size = 64 * 1024)
+		: block_size(block_size), slab_size(std::max(slab_size, block_size))
+	{
+		assert(block_size >= sizeof(FreeBlock));
+	}
+	~SlabPool()
+	{
+		for (void *slab : slabs)
+			::operator delete(slab, std::align_val_t(Slab_Align));
+	}
+
+	SlabPool(SlabPool &&other) noexcept
+		: block_size(other.block_size), slab_size(other.slab_size), slabs(std::move(other.slabs)),
+		  cur(other.cur), end(other.end), free_list(other.free_list)
+	{
+		other.slabs.clear();
+		other.cur = other.end = nullptr;
+		other.free_list = nullptr;
+	}
+	SlabPool(const SlabPool &other) = delete;
+	SlabPool &operator=(const SlabPool &other) = delete;
+
+	size_t blockSize() const { return block_size; }
+	size_t slabCount() const { return slabs.size(); }
+
+	void *allocate()
+	{
+		if (free_list)
+		{
+			FreeBlock *block = free_list;
+			free_list = block->next;
+			return block;
+		}
+		if (cur + block_size > end)
+		{
+			cur = static_cast<char *>(::operator new(slab_size, std::align_val_t(Slab_Align)));
+			end = cur + slab_size - slab_size % block_size;
+			slabs.push_back(cur);
+		}
+		void *block = cur;
+		cur += block_size;
+		return block;
+	}
+
+	void deallocate(void *ptr)
+	{
+		FreeBlock *block = static_cast<FreeBlock *>(ptr);
+		block->next = free_list;
+		free_list = block;
+	}
+};
+
+// per-tree allocator policy, objects are grouped into size classes (one SlabPool each),
+// so all nodes and all cells of a tree share a few pools.
+class ArenaAllocator
+{
+private:
+	static constexpr size_t Min_Align = alignof(std::max_align_t);
+
+	std::vector<SlabPool> pools; // a tree uses only a few size classes, linear search is enough
+
+	template <typename T>
+	static constexpr size_t sizeClass()
+	{
+		static_assert(alignof(T) <= 64, "over-aligned type is not supported");
+		constexpr size_t align = alignof(T) > Min_Align ? alignof(T) : Min_Align;
+		return (sizeof(T) + align - 1) / align * align;
+	}
+
+	SlabPool &pool(size_t size)
+	{
+		for (auto &p : pools)
+			if (p.blockSize() == size)
+				return p;
+		return pools.emplace_back(size);
+	}
+
+public:
+	ArenaAllocator() = default;
+	~ArenaAllocator() = default; // releases all slabs at once
+
+	ArenaAllocator(const ArenaAllocator &other) = delete;
+	ArenaAllocator &operator=(const ArenaAllocator &other) = delete;
+
+	template <typename T, typename... Args>
+	T *create(Args &&...args)
+	{
+		void *ptr = pool(sizeClass<T>()).allocate();
+		return new (ptr) T(std::forward<Args>(args)...);
+	}
+
+	template <typename T>
+	void destroy(T *ptr)
+	{
+		ptr->~T();
+		pool(sizeClass<T>()).deallocate(ptr);
+	}
+};
+
+// allocate each object with global new/delete
+class HeapAllocator
+{
+public:
+	template <typename T, typename... Args>
+	T *create(Args &&...args)
+	{
+		return new T(std::forward<Args>(args)...);
+	}
+
+	template <typename T>
+	void destroy(T *ptr)
+	{
+		delete ptr;
+	}
+};
+
+// objects of one type in chunks that never move, creating one bumps the end of the last chunk.
+// chunks double from Min_Chunk_Count objects, objects are destroyed with the arena in creation order
+template <typename T>
+class ObjectArena
+{
+private:
+	static constexpr size_t Min_Chunk_Count = 4;
+	static constexpr size_t Max_Chunk_Count = 256;
+
+	struct Chunk
+	{
+		T *objects;
+		size_t capacity;
+		size_t count;
+	};
+
+	std::vector<Chunk> chunks;
+	size_t count{0};
+
+	void release()
+	{
+		for (auto &chunk : chunks)
+		{
+			std::destroy_n(chunk.objects, chunk.count);
+			std::allocator<T>().deallocate(chunk.objects, chunk.capacity);
+		}
+		chunks.clear();
+		count = 0;
+	}
+
+public:
+	ObjectArena() = default;
+	~ObjectArena() { release(); }
+
+	ObjectArena(ObjectArena &&other) noexcept
+		: chunks(std::move(other.chunks)), count(other.count)
+	{
+		other.chunks.clear();
+		other.count = 0;
+	}
+	ObjectArena &operator=(ObjectArena &&other) noexcept
+	{
+		if (this != &other)
+		{
+			release();
+			chunks = std::move(other.chunks);
+			count = other.count;
+			other.chunks.clear();
+			other.count = 0;
+		}
+		return *this;
+	}
+	ObjectArena(const ObjectArena &other) = delete;
+	ObjectArena &operator=(const ObjectArena &other) = delete;
+
+	size_t size() const { return count; }
+	size_t chunkCount() const { return chunks.size(); }
+
+	template <typename... Args>
+	T *create(Args &&...args)
+	{
+		if (chunks.empty() || chunks.back().count == chunks.back().capacity)
+		{
+			size_t capacity = chunks.empty() ? Min_Chunk_Count : std::min(chunks.back().capacity * 2, Max_Chunk_Count);
+			chunks.push_back(Chunk{std::allocator<T>().allocate(capacity), capacity, 0});
+		}
+		Chunk &chunk = chunks.back();
+		T *object = std::construct_at(chunk.objects + chunk.count, std::forward<Args>(args)...);
+		++chunk.count;
+		++count;
+		return object;
+	}
+
+	// visits the objects in creation order, chunk by chunk
+	template <typename Func>
+	void forEach(Func &&func) const
+	{
+		for (const auto &chunk : chunks)
+			for (size_t i = 0; i < chunk.count; ++i)
+				func(chunk.objects[i]);
+	}
+};
+
+// append-only byte storage, consecutive appends are contiguous inside a chunk.
+// appended bytes never move and are only released when the arena is destroyed.
+// chunks double from Min_Chunk_Size, an arena holding a few keystrokes stays small
+class TextArena
+{
+private:
+	static constexpr size_t Min_Chunk_Size = 256;
+	static constexpr size_t Chunk_Size = 64 * 1024;
+
+	std::vector<std::unique_ptr<char[]>> chunks;
+	char *cur{nullptr};
+	char *end{nullptr};
+	size_t used{0};
+	size_t next_chunk{Min_Chunk_Size};
+
+public:
+	TextArena() = default;
+	TextArena(TextArena &&other) noexcept = default;
+	TextArena &operator=(TextArena &&other) noexcept = default;
+	TextArena(const TextArena &other) = delete;
+	TextArena &operator=(const TextArena &other) = delete;
+
+	size_t chunkCount() const { return chunks.size(); }
+	size_t bytes() const { return used; }
+
+	// uninitialized room for size bytes
+	char *allocate(size_t size)
+	{
+		used += size;
+		if (size > Chunk_Size / 4) // large text gets a chunk of its own, the current one keeps filling
+			return chunks.emplace_back(std::make_unique_for_overwrite<char[]>(size)).get();
+		if (static_cast<size_t>(end - cur) < size)
+		{
+			size_t chunk_size = std::max(next_chunk, size);
+			next_chunk = std::min(next_chunk * 2, Chunk_Size);
+			cur = chunks.emplace_back(std::make_unique_for_overwrite<char[]>(chunk_size)).get();
+			end = cur + chunk_size;
+		}
+		char *dest = cur;
+		cur += size;
+		return dest;
+	}
+
+	// whether the next append() of size bytes is placed at `at`, right after the previous one
+	bool appendsAt(const char *at, size_t size) const
+	{
+		return at == cur && size <= Chunk_Size / 4 && size <= static_cast<size_t>(end - cur);
+	}
+
+	// returns the copy of [data, data + size)
+	const char *append(const char *data, size_t size)
+	{
+		char *dest = allocate(size);
+		if (size > 0)
+			memcpy(dest, data, size);
+		return dest;
+	}
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// sorted map from distinct size_t keys to values, kept in chunks of at most Chunk_Size entries with the
+// first key of every chunk in one array. a lookup is two binary searches over contiguous keys, an insert
+// or erase moves the rest of one chunk and, when a chunk splits or runs empty, the chunk list.
+// that is O(Chunk_Size + n / Chunk_Size) moves where one sorted vector moves O(n)
+template <typename T, size_t Chunk_Size = 64>
+class ChunkedIndex
+{
+private:
+	using Entry = std::pair<size_t, T>;
+	using Chunk = std::vector<Entry>;
+
+	std::vector<Chunk> chunks; // none of them empty
+	std::vector<size_t> firsts; // first key of each chunk
+
+	// the last chunk whose first key is at most key, the first one if there is none
+	size_t chunkOf(size_t key) const
+	{
+		return std::upper_bound(firsts.begin() + 1, firsts.end(), key) - firsts.begin() - 1;
+	}
+
+	// the first entry of chunk with a key above key
+	static typename Chunk::const_iterator after(const Chunk &chunk, size_t key)
+	{
+		return std::upper_bound(chunk.begin(), chunk.end(), key, [](size_t k, const Entry &entry)
+		{
+			return k < entry.first;
+		});
+	}
+
+	// the chunk and index of the entry with exactly key
+	std::pair<size_t, size_t> locate(size_t key) const
+	{
+		assert(!chunks.empty());
+		size_t c = chunkOf(key);
+		auto it = after(chunks[c], key);
+		assert(it != chunks[c].begin() && it[-1].first == key);
+		return {c, it - chunks[c].begin() - 1};
+	}
+
+public:
+	bool empty() const { return chunks.empty(); }
+
+	// the value of the last key at most key, there has to be one
+	const T &floor(size_t key) const
+	{
+		assert(!chunks.empty());
+		const Chunk &chunk = chunks[chunkOf(key)];
+		auto it = after(chunk, key);
+		assert(it != chunk.begin());
+		return it[-1].second;
+	}
+
+	// key has to be above every key in the index
+	void push_back(size_t key, T value)
+	{
+		assert(chunks.empty() || chunks.back().back().first < key);
+		if (chunks.empty() || chunks.back().size() == Chunk_Size)
+		{
+			chunks.emplace_back().reserve(Chunk_Size);
+			firsts.push_back(key);
+		}
+		chunks.back().emplace_back(key, std::move(value));
+	}
+
+	void insert(size_t key, T value)
+	{
+		if (chunks.empty())
+			return push_back(key, std::move(value));
+		size_t c = chunkOf(key);
+		Chunk &chunk = chunks[c];
+		auto it = chunk.insert(after(chunk, key), Entry(key, std::move(value)));
+		if (it == chunk.begin())
+			firsts[c] = key;
+		if (chunk.size() <= Chunk_Size)
+			return;
+		// a full chunk splits into halves, both have room for Chunk_Size / 2 more
+		Chunk upper;
+		upper.reserve(Chunk_Size);
+		upper.assign(std::make_move_iterator(chunk.begin() + Chunk_Size / 2), std::make_move_iterator(chunk.end()));
+		chunk.resize(Chunk_Size / 2);
+		firsts.insert(firsts.begin() + c + 1, upper.front().first);
+		chunks.insert(chunks.begin() + c + 1, std::move(upper));
+	}
+
+	// removes the entry with exactly key
+	void erase(size_t key)
+	{
+		auto [c, i] = locate(key);
+		Chunk &chunk = chunks[c];
+		chunk.erase(chunk.begin() + i);
+		if (chunk.empty())
+		{
+			chunks.erase(chunks.begin() + c);
+			firsts.erase(firsts.begin() + c);
+		}
+		else if (i == 0)
+			firsts[c] = chunk.front().first;
+	}
+
+	// the entry with exactly key gets value
+	void replace(size_t key, T value)
+	{
+		auto [c, i] = locate(key);
+		chunks[c][i].second = std::move(value);
+	}
+
+	// visits the values in key order
+	template <typename Func>
+	void forEach(Func &&func) const
+	{
+		for (const Chunk &chunk : chunks)
+			for (const Entry &entry : chunk)
+				func(entry.second);
+	}
+};
@@ -1,7 +1,9 @@
 ﻿#pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <string>
+#include <string_view>
 
 #define UUID_SYSTEM_GENERATOR
 #include <stduuid/uuid.h>
@@ -9,6 +11,17 @@
 // guid
 using ReplicaID = uuids::uuid;
 
+// UUIDs are random, folding their halves is enough
+struct ReplicaIDHash
+{
+	size_t operator()(const ReplicaID &id) const
+	{
+		uint64_t half[2];
+		memcpy(half, id.as_bytes().data(), sizeof(half));
+		return static_cast<size_t>(half[0] ^ half[1] * 0x9e3779b97f4a7c15ull);
+	}
+};
+
 struct OperationID
 {
 	ReplicaID replica{};
@@ -57,9 +70,28 @@ struct Insertion : public Operation
 {
 	Anchor anchor;
 	std::string str;
+	bool continues; // the author typed it right behind its latest insertion, see BasicPieceCRDT::continuesTyping()
+
+	Insertion(const ReplicaID &replica, uint32_t stamp, const Anchor &anchor, std::string text, bool continues = false)
+		: Operation(replica, stamp, OperationType::Insert), anchor(anchor), str(std::move(text)), continues(continues)
+	{
+	}
+};
 
-	Insertion(const ReplicaID &replica, uint32_t stamp, const Anchor &anchor, std::string text)
-		: Operation(replica, stamp, OperationType::Insert), anchor(anchor), str(std::move(text))
+// an insertion whose text lies in a buffer owned elsewhere, e.g. a network receive buffer
+struct InsertionView : public Operation
+{
+	Anchor anchor;
+	std::string_view str;
+	bool continues;
+
+	InsertionView(const ReplicaID &replica, uint32_t stamp, const Anchor &anchor, std::string_view text,
+				  bool continues = false)
+		: Operation(replica, stamp, OperationType::Insert), anchor(anchor), str(text), continues(continues)
+	{
+	}
+	InsertionView(const Insertion &op)
+		: InsertionView(op.replica, op.stamp, op.anchor, op.str, op.continues)
 	{
 	}
 };
@@ -1,14 +1,104 @@
 ﻿#pragma once
 #include <algorithm>
 #include <array>
+#include <bit>
 #include <cassert>
 #include <cstdint>
+#include <iterator>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "arena.hpp"
+#include "prefixsum.hpp"
 #include "taggedptr.hpp"
 
+// keys made of several size_t metrics opt in the structure-of-arrays layout by
+// `static constexpr bool metric_layout = true;`
+template <typename K>
+concept MetricKey = K::metric_layout && std::is_trivially_copyable_v<K> && sizeof(K) % sizeof(size_t) == 0;
+
+// structure-of-arrays key storage, one cache line aligned array per metric,
+// so searching by one metric does not load the others
+template <typename K, uint8_t N>
+struct MetricArray
+{
+	static constexpr size_t Metrics = sizeof(K) / sizeof(size_t);
+	static constexpr size_t Stride = (N + 7) / 8 * 8; // pad each metric to whole cache lines
+	using Metric = std::array<size_t, Metrics>;
+
+	alignas(64) std::array<std::array<size_t, Stride>, Metrics> metrics;
+
+	class Ref
+	{
+		MetricArray *keys;
+		uint8_t index;
+
+	public:
+		Ref(MetricArray *keys, uint8_t index)
+			: keys(keys), index(index) {}
+
+		operator K() const { return keys->get(index); }
+		Ref &operator=(const K &key)
+		{
+			keys->set(index, key);
+			return *this;
+		}
+		Ref &operator=(const Ref &other)
+		{
+			return *this = K(other);
+		}
+	};
+
+	K get(uint8_t index) const
+	{
+		Metric key;
+		for (size_t m = 0; m < Metrics; ++m)
+			key[m] = metrics[m][index];
+		return std::bit_cast<K>(key);
+	}
+
+	void set(uint8_t index, const K &key)
+	{
+		Metric values = std::bit_cast<Metric>(key);
+		for (size_t m = 0; m < Metrics; ++m)
+			metrics[m][index] = values[m];
+	}
+
+	// sum of keys in [begin, end)
+	K sum(uint8_t begin, uint8_t end) const
+	{
+		Metric total{};
+		for (size_t m = 0; m < Metrics; ++m)
+			for (uint8_t i = begin; i < end; ++i)
+				total[m] += metrics[m][i];
+		return std::bit_cast<K>(total);
+	}
+
+	Ref operator[](uint8_t index) { return Ref(this, index); }
+	K operator[](uint8_t index) const { return get(index); }
+};
+
+template <typename K, uint8_t N>
+using KeyArray = std::conditional_t<MetricKey<K>, MetricArray<K, N>, std::array<K, N>>;
+
+// keys may give every internal node a value for state of the tree built on them, such as lazy updates,
+// by `using NodeState = T;`. it is value-initialized when the node is created
+template <typename K>
+struct NodeStateOf
+{
+	struct type
+	{
+	};
+};
+
+template <typename K>
+	requires requires { typename K::NodeState; }
+struct NodeStateOf<K>
+{
+	using type = typename K::NodeState;
+};
+
 template <typename K, uint8_t N>
 struct InternalNode;
 
@@ -19,7 +109,7 @@ struct Node
 	uint8_t index{0}; // index in parent's children array
 	uint8_t count{0}; // number of keys
 	InternalNode<K, N> *parent{nullptr};
-	std::array<K, N> keys;
+	KeyArray<K, N> keys;
 
 	Node(bool leaf = false) : is_leaf(leaf) {}
 };
@@ -28,6 +118,7 @@ template <typename K, uint8_t N>
 struct InternalNode : public Node<K, N>
 {
 	std::array<Node<K, N> *, N> subs;
+	[[no_unique_address]] typename NodeStateOf<K>::type state{};
 
 	InternalNode() : Node<K, N>(false) {}
 
@@ -51,6 +142,91 @@ struct InternalNode : public Node<K, N>
 	{
 		other->set(index2, this->keys[index1], subs[index1]);
 	}
+
+	void insert(uint8_t index, const K &key, Node<K, N> *child)
+	{
+		for (int i = this->count; i > index; --i)
+			move(i - 1, i);
+		set(index, key, child);
+		++this->count;
+	}
+
+	void erase(uint8_t index)
+	{
+		for (int i = index + 1; i < this->count; ++i)
+			move(i, i - 1);
+		--this->count;
+	}
+
+	// move the child at `from` of other to `to` of this node
+	void takeFrom(InternalNode *other, uint8_t from, uint8_t to)
+	{
+		for (int i = this->count; i > to; --i)
+			move(i - 1, i);
+		other->move(from, this, to);
+		++this->count;
+		other->erase(from);
+	}
+};
+
+// leaf node with a gap buffer, the gap follows the last inserted position,
+// so consecutive inserts at the same place move no other element.
+// `set` and `move` of the derived leaf address physical slots, other methods take logical indices.
+template <typename Derived, typename K, uint8_t N>
+struct GapNode : public Node<K, N>
+{
+	uint8_t gap{0}; // logical index where the gap begins
+
+	GapNode() : Node<K, N>(true) {}
+
+	uint8_t gapSize() const { return N - this->count; }
+	uint8_t slot(uint8_t index) const { return index < gap ? index : index + gapSize(); }
+	uint8_t logical(uint8_t slot) const { return slot < gap ? slot : slot - gapSize(); }
+
+	decltype(auto) key(uint8_t index) { return this->keys[slot(index)]; }
+	decltype(auto) key(uint8_t index) const { return this->keys[slot(index)]; }
+
+	void moveGap(uint8_t index)
+	{
+		Derived *self = static_cast<Derived *>(this);
+		uint8_t size = gapSize();
+		if (size != 0)
+		{
+			for (; gap > index; --gap)
+				self->move(gap - 1, gap - 1 + size);
+			for (; gap < index; ++gap)
+				self->move(gap + size, gap);
+		}
+		gap = index;
+	}
+
+	template <typename... Args>
+	void insert(uint8_t index, Args &&...args)
+	{
+		moveGap(index);
+		static_cast<Derived *>(this)->set(gap++, std::forward<Args>(args)...);
+		++this->count;
+	}
+
+	// the erased slot joins the gap, the cell is not touched
+	void erase(uint8_t index)
+	{
+		moveGap(index + 1);
+		--gap;
+		--this->count;
+	}
+
+	// move the entry at `from` of other to `to` of this node
+	void takeFrom(Derived *other, uint8_t from, uint8_t to)
+	{
+		other->moveGap(from + 1); // the entry is now right before the gap, at slot `from`
+		moveGap(to);
+		other->move(from, static_cast<Derived *>(this), gap);
+		--other->gap;
+		--other->count;
+		++gap;
+		++this->count;
+	}
 };
 
 template <typename L>
@@ -73,19 +249,35 @@ struct SentinelNode
 		: node(node), index(index) {}
 };
 
-// a grow only b+tree
+constexpr size_t Cache_Line_Size = 64;
+
+// minimum degree N for keys of type K, so that keys and children of a full node (2 * N - 1 of them)
+// span about `lines` cache lines
+template <typename K>
+constexpr uint8_t defaultFanout(size_t lines = 8)
+{
+	size_t order = lines * Cache_Line_Size / (sizeof(K) + sizeof(void *));
+	return static_cast<uint8_t>(std::clamp<size_t>((order + 1) / 2, 2, 64));
+}
+
+// a b+tree with insertion and erasure, underflowing nodes borrow from or merge with a sibling
 // find method is provided by derived classes
-template <typename K, typename Leaf, uint8_t N, typename Summarizer>
+// nodes, sentinel and cells are created by Allocator, which is owned by the tree
+template <typename K, typename Leaf, uint8_t N, typename Summarizer, typename Allocator = ArenaAllocator>
 	requires std::is_base_of_v<Node<K, 2 * N - 1>, Leaf>
 class BPlusTree
 {
 protected:
 	static constexpr uint8_t ORDER = 2 * N - 1;
+	// minimum keys of non-root nodes, internal nodes keep at least two children so every child has a sibling
+	static constexpr uint8_t MIN_LEAF = N - 1;
+	static constexpr uint8_t MIN_INTERNAL = N - 1 < 2 ? 2 : N - 1;
 	using Node = Node<K, ORDER>;
 	using InternalNode = InternalNode<K, ORDER>;
 	using LeafNode = Leaf;
 	using BaseIter = BaseIter<LeafNode>;
 
+	Allocator alloc;
 	Node *root{nullptr};
 	LeafNode *first{nullptr};
 	LeafNode *last{nullptr};
@@ -94,15 +286,35 @@ protected:
 public:
 	BPlusTree()
 	{
-		root = first = last = new LeafNode();
-		auto sentinel = new SentinelNode<LeafNode>(last, 0);
+		root = first = last = alloc.template create<LeafNode>();
+		auto sentinel = alloc.template create<SentinelNode<LeafNode>>(last, 0);
 		last->next = sentinel;
 	}
-	~BPlusTree() {}
+	~BPlusTree()
+	{
+		alloc.destroy(last->next.asSpecial());
+		destroyNode(root);
+	}
+
+	BPlusTree(const BPlusTree &other) = delete;
+	BPlusTree &operator=(const BPlusTree &other) = delete;
 
 	size_t size() const { return sz; }
 
 protected:
+	static K summarize(const Node *node)
+	{
+		if (!node->is_leaf)
+			return Summarizer()(node->keys, node->count);
+		const LeafNode *leaf = static_cast<const LeafNode *>(node);
+		if (leaf->gap >= leaf->count)
+			return Summarizer()(leaf->keys, leaf->count);
+		KeyArray<K, ORDER> keys;
+		for (uint8_t i = 0; i < leaf->count; ++i)
+			keys[i] = leaf->key(i);
+		return Summarizer()(keys, leaf->count);
+	}
+
 	template <typename... Args>
 	BaseIter insertLeaf(LeafNode *leaf, uint8_t index, Args &&...args)
 	{
@@ -130,7 +342,91 @@ protected:
 		}
 	}
 
+	// destroys the cell at index of leaf, then borrows from or merges with siblings if the leaf underflows.
+	// cells of other entries are kept, only their node and index change
+	void eraseLeaf(LeafNode *leaf, uint8_t index)
+	{
+		--sz;
+		auto cell = leaf->get(index);
+		leaf->erase(index); // may move the cell along with the gap
+		alloc.destroy(cell);
+		if (leaf->parent && leaf->count < MIN_LEAF)
+			rebalance(leaf);
+		else
+			propagate(leaf);
+	}
+
+	// fills an empty tree bottom-up with `count` entries in order, entries are spread evenly over packed leaves.
+	// fill(leaf, slot) stores the next entry at the slot
+	template <typename Fill>
+	void bulkLoad(size_t count, const Fill &fill)
+	{
+		assert(sz == 0 && "bulk load needs an empty tree");
+		if (count == 0)
+			return;
+		sz = count;
+
+		std::vector<Node *> level;
+		size_t leaves = (count + ORDER - 1) / ORDER;
+		level.reserve(leaves);
+		auto sentinel = last->next.asSpecial();
+		LeafNode *prev = nullptr;
+		for (size_t l = 0; l < leaves; ++l)
+		{
+			LeafNode *leaf = l == 0 ? first : alloc.template create<LeafNode>();
+			uint8_t n = static_cast<uint8_t>(count / leaves + (l < count % leaves));
+			for (uint8_t i = 0; i < n; ++i)
+				fill(leaf, i);
+			leaf->count = leaf->gap = n;
+			if (prev)
+			{
+				prev->next = leaf;
+				leaf->prev = prev;
+			}
+			prev = leaf;
+			level.push_back(leaf);
+		}
+		last = prev;
+		last->next = sentinel;
+		sentinel->node = last;
+
+		while (level.size() > 1)
+		{
+			size_t parents = (level.size() + ORDER - 1) / ORDER;
+			std::vector<Node *> upper;
+			upper.reserve(parents);
+			size_t child = 0;
+			for (size_t p = 0; p < parents; ++p)
+			{
+				InternalNode *node = alloc.template create<InternalNode>();
+				uint8_t n = static_cast<uint8_t>(level.size() / parents + (p < level.size() % parents));
+				for (uint8_t i = 0; i < n; ++i, ++child)
+					node->set(i, summarize(level[child]), level[child]);
+				node->count = n;
+				upper.push_back(node);
+			}
+			level = std::move(upper);
+		}
+		root = level[0];
+	}
+
 private:
+	void destroyNode(Node *node)
+	{
+		if (node->is_leaf)
+		{
+			LeafNode *leaf = static_cast<LeafNode *>(node);
+			for (uint8_t i = 0; i < leaf->count; ++i)
+				alloc.destroy(leaf->get(i));
+			alloc.destroy(leaf);
+			return;
+		}
+		InternalNode *internal = static_cast<InternalNode *>(node);
+		for (uint8_t i = 0; i < internal->count; ++i)
+			destroyNode(internal->subs[i]);
+		alloc.destroy(internal);
+	}
+
 	void insertInternal(InternalNode *node, uint8_t index, const K &key, Node *child)
 	{
 		if (node->count < ORDER)
@@ -144,14 +440,16 @@ private:
 	{
 		assert(node->count < ORDER);
 
-		for (int i = node->count; i > index; --i)
-			node->move(i - 1, i);
-		node->set(index, std::forward<Args>(args)...);
-		++node->count;
+		node->insert(index, std::forward<Args>(args)...);
+		propagate(node);
+	}
 
+	// update summaries of ancestors, stops when a summary is unchanged
+	void propagate(Node *node)
+	{
 		for (Node *current = node; current->parent; current = current->parent)
 		{
-			K new_key = Summarizer()(current->keys.data(), current->count);
+			K new_key = summarize(current);
 			if (new_key != current->parent->keys[current->index])
 				current->parent->keys[current->index] = new_key;
 			else
@@ -159,12 +457,75 @@ private:
 		}
 	}
 
+	template <typename NodeType>
+	void rebalance(NodeType *node)
+	{
+		constexpr uint8_t MIN = std::is_same_v<NodeType, LeafNode> ? MIN_LEAF : MIN_INTERNAL;
+		InternalNode *parent = node->parent;
+		uint8_t index = node->index;
+		NodeType *left = index > 0 ? static_cast<NodeType *>(parent->subs[index - 1]) : nullptr;
+		NodeType *right = index + 1 < parent->count ? static_cast<NodeType *>(parent->subs[index + 1]) : nullptr;
+
+		// borrow one entry from a sibling
+		if (left && left->count > MIN)
+		{
+			node->takeFrom(left, left->count - 1, 0);
+			parent->keys[index - 1] = summarize(left);
+			parent->keys[index] = summarize(node);
+			propagate(parent);
+			return;
+		}
+		if (right && right->count > MIN)
+		{
+			node->takeFrom(right, 0, node->count);
+			parent->keys[index] = summarize(node);
+			parent->keys[index + 1] = summarize(right);
+			propagate(parent);
+			return;
+		}
+
+		// merge the right one of two siblings into the left one
+		NodeType *dst = left ? left : node;
+		NodeType *src = left ? node : right;
+		while (src->count > 0)
+			dst->takeFrom(src, 0, dst->count);
+		if constexpr (std::is_same_v<NodeType, LeafNode>)
+		{
+			if (src->next.isSpecial())
+			{
+				last = dst;
+				src->next.asSpecial()->node = dst;
+			}
+			else
+				src->next->prev = dst;
+			dst->next = src->next;
+		}
+		parent->keys[dst->index] = summarize(dst);
+		parent->erase(src->index);
+		alloc.destroy(src);
+
+		if (parent == root)
+		{
+			if (parent->count == 1)
+			{
+				root = dst;
+				dst->parent = nullptr;
+				alloc.destroy(parent);
+			}
+		}
+		else if (parent->count < MIN_INTERNAL)
+			rebalance(parent);
+		else
+			propagate(parent);
+	}
+
 	template <typename NodeType, typename... Args>
 	NodeType *splitNode(NodeType *node, uint8_t index, Args &&...args)
 	{
 		assert(node->count == ORDER);
 
-		NodeType *new_node = new NodeType();
+		// a full node has no gap, physical slots equal logical indices
+		NodeType *new_node = alloc.template create<NodeType>();
 		if (index < N)
 		{
 			for (int i = ORDER; i >= N; --i)
@@ -183,16 +544,18 @@ private:
 		}
 
 		node->count = new_node->count = N;
+		if constexpr (std::is_same_v<NodeType, LeafNode>)
+			node->gap = new_node->gap = N;
 		if (node->parent)
 		{
-			node->parent->keys[node->index] = Summarizer()(node->keys.data(), node->count);
-			insertInternal(node->parent, node->index + 1, Summarizer()(new_node->keys.data(), new_node->count), new_node);
+			node->parent->keys[node->index] = summarize(node);
+			insertInternal(node->parent, node->index + 1, summarize(new_node), new_node);
 		}
 		else
 		{
-			InternalNode *new_root = new InternalNode();
-			new_root->set(0, Summarizer()(node->keys.data(), node->count), node);
-			new_root->set(1, Summarizer()(new_node->keys.data(), new_node->count), new_node);
+			InternalNode *new_root = alloc.template create<InternalNode>();
+			new_root->set(0, summarize(node), node);
+			new_root->set(1, summarize(new_node), new_node);
 			new_root->count = 2;
 			root = new_root;
 		}
@@ -201,10 +564,15 @@ private:
 };
 
 // leaf node types when we want to get iterators from value ptrs
+// `index` of a cell is its physical slot in the leaf, use `L::logical` to get the logical index
 template <typename V, typename L>
 struct PinnedCell : public BaseIter<L>
 {
-	mutable V value{};
+	// small values would otherwise be packed into the tail padding of BaseIter
+	static constexpr size_t Value_Align = std::max(alignof(V), alignof(BaseIter<L>));
+	static constexpr size_t Value_Offset = (sizeof(BaseIter<L>) + Value_Align - 1) / Value_Align * Value_Align;
+
+	alignas(Value_Align) mutable V value{};
 
 	PinnedCell() = default;
 	PinnedCell(V val)
@@ -212,8 +580,8 @@ struct PinnedCell : public BaseIter<L>
 
 	static PinnedCell *cellOf(V *val)
 	{
-		// assert((size_t)(&cell->value) - (size_t)cell.raw() == sizeof(BaseIter<L>));
-		return reinterpret_cast<PinnedCell *>((size_t)val - sizeof(BaseIter<L>));
+		// assert((size_t)(&cell->value) - (size_t)cell.raw() == Value_Offset);
+		return reinterpret_cast<PinnedCell *>((size_t)val - Value_Offset);
 	}
 };
 
@@ -248,7 +616,7 @@ struct PinnedIter
 	BaseIter<L> toBaseIter() const
 	{
 		if (cell.isNormal())
-			return BaseIter<L>(cell->node, cell->index);
+			return BaseIter<L>(cell->node, cell->node->logical(cell->index));
 		auto sentinel = cell.asSpecial();
 		return BaseIter<L>(sentinel->node, sentinel->node->count);
 	}
@@ -266,8 +634,9 @@ struct PinnedIter
 	{
 		assert(cell.isNormal() && "Cannot increment sentinel iterator");
 		L *node = cell->node;
-		if (cell->index + 1 < node->count)
-			cell = node->get(cell->index + 1);
+		uint8_t index = node->logical(cell->index);
+		if (index + 1 < node->count)
+			cell = node->get(index + 1);
 		else if (node->next.isSpecial())
 			cell = node->next.asSpecial();
 		else
@@ -290,9 +659,10 @@ struct PinnedIter
 		else
 		{
 			L *node = cell->node;
+			uint8_t index = node->logical(cell->index);
 			assert(node->prev.isNormal() && "Cannot decrement begin iterator");
-			if (cell->index > 0)
-				cell = node->get(cell->index - 1);
+			if (index > 0)
+				cell = node->get(index - 1);
 			else
 			{
 				node = node->prev.asNormal();
@@ -310,7 +680,7 @@ struct PinnedIter
 };
 
 template <typename K, typename V, uint8_t N>
-struct LeafNode : public Node<K, N>
+struct LeafNode : public GapNode<LeafNode<K, V, N>, K, N>
 {
 	using Cell = PinnedCell<V, LeafNode>;
 	using NodePtr = TaggedPtr<LeafNode, SentinelNode<LeafNode>>;
@@ -318,11 +688,11 @@ struct LeafNode : public Node<K, N>
 	NodePtr prev;
 	NodePtr next;
 
-	LeafNode() : Node<K, N>(true) {}
+	LeafNode() = default;
 
 	Cell *get(uint8_t index)
 	{
-		return subs[index];
+		return subs[this->slot(index)];
 	}
 
 	void set(uint8_t index, const K &key, Cell *value)
@@ -345,18 +715,18 @@ struct LeafNode : public Node<K, N>
 };
 
 template <typename K, uint8_t N>
-struct KeyOnlyLeafNode : public Node<K *, N>
+struct KeyOnlyLeafNode : public GapNode<KeyOnlyLeafNode<K, N>, K *, N>
 {
 	using Cell = PinnedCell<K, KeyOnlyLeafNode>;
 	using NodePtr = TaggedPtr<KeyOnlyLeafNode, SentinelNode<KeyOnlyLeafNode>>;
 	NodePtr prev;
 	NodePtr next;
 
-	KeyOnlyLeafNode() : Node<K *, N>(true) {}
+	KeyOnlyLeafNode() = default;
 
 	Cell *get(uint8_t index)
 	{
-		return Cell::cellOf(this->keys[index]);
+		return Cell::cellOf(this->key(index));
 	}
 
 	void set(uint8_t index, Cell *key)
@@ -368,40 +738,64 @@ struct KeyOnlyLeafNode : public Node<K *, N>
 
 	void move(uint8_t index1, uint8_t index2)
 	{
-		set(index2, get(index1));
+		set(index2, Cell::cellOf(this->keys[index1]));
 	}
 
 	void move(uint8_t index1, KeyOnlyLeafNode *other, uint8_t index2)
 	{
-		other->set(index2, get(index1));
+		other->set(index2, Cell::cellOf(this->keys[index1]));
 	}
 };
 
 template <typename T>
 struct AddSummarizer
 {
-	T operator()(const T *keys, size_t count) const
+	template <size_t N>
+	T operator()(const std::array<T, N> &keys, size_t count) const
 	{
 		T sum{};
 		for (int i = 0; i < count; ++i)
 			sum += keys[i];
 		return sum;
 	}
+
+	template <uint8_t N>
+	T operator()(const MetricArray<T, N> &keys, size_t count) const
+	{
+		return keys.sum(0, count);
+	}
 };
 
-template <typename K, typename V, uint8_t N>
-class Sequence : public BPlusTree<K, LeafNode<K, V, 2 * N - 1>, N, AddSummarizer<K>>
+template <typename K, typename V, uint8_t N, typename Allocator = ArenaAllocator>
+class Sequence : public BPlusTree<K, LeafNode<K, V, 2 * N - 1>, N, AddSummarizer<K>, Allocator>
 {
 protected:
-	using Base = BPlusTree<K, LeafNode<K, V, 2 * N - 1>, N, AddSummarizer<K>>;
+	using Base = BPlusTree<K, LeafNode<K, V, 2 * N - 1>, N, AddSummarizer<K>, Allocator>;
 	using Node = typename Base::Node;
 	using InternalNode = typename Base::InternalNode;
 	using LeafNode = typename Base::LeafNode;
 
+	// finger: the leaf of the last findMetric and the offset where it begins. an insert, erase or update
+	// inside that leaf keeps it, since the leaf still begins at the same offset. any change to another
+	// leaf drops it, and so does one that can split, merge or borrow in the finger leaf
+	mutable LeafNode *finger_leaf{nullptr};
+	mutable K finger_offset{};
+	mutable size_t finger_hits{0};
+	mutable size_t finger_misses{0};
+
 public:
 	Sequence() {}
+	template <std::forward_iterator It>
+	Sequence(It begin, It end)
+	{
+		build(begin, end);
+	}
 	~Sequence() {}
 
+	// lookups that started below the root / from the root
+	size_t fingerHits() const { return finger_hits; }
+	size_t fingerMisses() const { return finger_misses; }
+
 	class Iterator : public PinnedIter<V, LeafNode>
 	{
 		K offset{0};
@@ -429,8 +823,12 @@ public:
 
 		void update()
 		{
-			uint8_t index = this->cell->index;
-			for (Node *current = this->cell->node; current; current = current->parent)
+			LeafNode *leaf = this->cell->node;
+			uint8_t index = leaf->logical(this->cell->index);
+			for (uint8_t i = 0; i < index; ++i)
+				offset += leaf->key(i);
+			index = leaf->index;
+			for (Node *current = leaf->parent; current; current = current->parent)
 			{
 				for (int i = 0; i < index; ++i)
 					offset += current->keys[i];
@@ -439,7 +837,7 @@ public:
 		}
 
 		// key and value can be modified, but remember to call update
-		K &key()
+		decltype(auto) key()
 		{
 			return this->leaf()->keys[this->cell->index];
 		}
@@ -475,12 +873,12 @@ public:
 
 	Iterator begin() const
 	{
-		return Iterator(this->first->subs[0]);
+		return Iterator(this->first->get(0));
 	}
 
 	Iterator end() const
 	{
-		return Iterator(this->last->next.asSpecial(), AddSummarizer<K>()(this->root->keys.data(), this->root->count));
+		return Iterator(this->last->next.asSpecial(), this->summarize(this->root));
 	}
 
 	template <typename T, typename Compare = std::less<>>
@@ -489,7 +887,7 @@ public:
 		Node *current = this->root;
 		K accumulated{};
 		uint8_t index = 0;
-		while (1)
+		while (!current->is_leaf)
 		{
 			for (index = 0; index < current->count; ++index)
 			{
@@ -499,19 +897,108 @@ public:
 			}
 			if (index >= current->count)
 				return end();
-			if (current->is_leaf)
+			current = static_cast<InternalNode *>(current)->subs[index];
+		}
+		LeafNode *leaf = static_cast<LeafNode *>(current);
+		for (index = 0; index < leaf->count; ++index)
+		{
+			if (cmp(pos, accumulated + leaf->key(index)))
+				break;
+			accumulated += leaf->key(index);
+		}
+		if (index >= leaf->count)
+			return end();
+		return Iterator(leaf, index, accumulated);
+	}
+
+	// find by one metric of K, where K is made of size_t metrics and `Metric` is the index of one of them.
+	// same as find(pos, cmp) with cmp(pos, key) = pos < key.metric, but scans each node with prefixSearch
+	template <size_t Metric>
+	Iterator findMetric(size_t pos) const
+	{
+		K accumulated{};
+		Node *current = climbFinger<Metric>(pos, accumulated);
+		uint8_t index = 0;
+		while (!current->is_leaf)
+		{
+			index = searchMetric<Metric>(current->keys, 0, current->count, pos, accumulated);
+			if (index >= current->count)
+				return end();
+			current = static_cast<InternalNode *>(current)->subs[index];
+		}
+		// the gap splits leaf keys into two ranges
+		LeafNode *leaf = static_cast<LeafNode *>(current);
+		finger_leaf = leaf;
+		finger_offset = accumulated;
+		uint8_t gap = std::min(leaf->gap, leaf->count);
+		index = searchMetric<Metric>(leaf->keys, 0, gap, pos, accumulated);
+		if (index >= gap)
+			index = gap + searchMetric<Metric>(leaf->keys, leaf->slot(gap), leaf->count - gap, pos, accumulated);
+		if (index >= leaf->count)
+			return end();
+		return Iterator(leaf, index, accumulated);
+	}
+
+	// first value at or after it whose `Metric` is not zero, subtrees summing to zero are skipped as a whole
+	template <size_t Metric>
+	Iterator skipEmpty(Iterator it) const
+	{
+		if (it.cell.isSpecial())
+			return it;
+		auto base_it = it.toBaseIter();
+		return skipEmpty<Metric>(base_it.node, base_it.index, it.offset);
+	}
+
+protected:
+	// same as above from the child `index` of node, offset is the position of that child
+	template <size_t Metric>
+	Iterator skipEmpty(Node *current, uint8_t index, K offset) const
+	{
+		auto key = [](Node *node, uint8_t i) -> K
+		{
+			return node->is_leaf ? static_cast<LeafNode *>(node)->key(i) : node->keys[i];
+		};
+		// scan the rest of the node, then continue after it in the parent
+		for (;; index = current->index + 1, current = current->parent)
+		{
+			for (; index < current->count && metricOf<Metric>(key(current, index)) == 0; ++index)
+				offset += key(current, index);
+			if (index < current->count)
 				break;
+			if (current->parent == nullptr)
+				return end();
+		}
+		// descend into the first child with a non-zero sum
+		while (!current->is_leaf)
+		{
 			current = static_cast<InternalNode *>(current)->subs[index];
+			for (index = 0; metricOf<Metric>(key(current, index)) == 0; ++index)
+				offset += key(current, index);
 		}
-		return Iterator(static_cast<LeafNode *>(current), index, accumulated);
+		return Iterator(static_cast<LeafNode *>(current), index, offset);
+	}
+
+public:
+	// bulk load an empty sequence from values in order, O(n)
+	template <std::forward_iterator It>
+	void build(It begin, It end)
+	{
+		finger_leaf = nullptr;
+		this->bulkLoad(std::distance(begin, end), [this, &begin](LeafNode *leaf, uint8_t slot)
+		{
+			auto cell = this->alloc.template create<typename LeafNode::Cell>(*begin++);
+			leaf->set(slot, cell->value.size(), cell);
+		});
 	}
 
 	Iterator insertBefore(Iterator it, V value)
 	{
 		auto key = value.size();
 		auto offset = it.position();
-		auto cell = new LeafNode::Cell(std::move(value));
+		auto cell = this->alloc.template create<typename LeafNode::Cell>(std::move(value));
 		auto base_it = it.toBaseIter();
+		if (base_it.node != finger_leaf || base_it.node->count == this->ORDER)
+			finger_leaf = nullptr;
 		base_it = this->insertLeaf(base_it.node, base_it.index, key, cell);
 		return Iterator(base_it.node, base_it.index, offset);
 	}
@@ -521,8 +1008,23 @@ public:
 		return insertBefore(++it, std::move(value));
 	}
 
+	// removes the value at it, returns the iterator after it
+	Iterator erase(Iterator it)
+	{
+		Iterator next = it;
+		++next;
+		next.offset = it.offset;
+		auto base_it = it.toBaseIter();
+		if (base_it.node != finger_leaf || base_it.node->count <= this->MIN_LEAF)
+			finger_leaf = nullptr;
+		this->eraseLeaf(base_it.node, base_it.index);
+		return next;
+	}
+
 	void update(Iterator begin, Iterator end)
 	{
+		if (begin.leaf() != finger_leaf)
+			finger_leaf = nullptr;
 		std::vector<Node *> stack;
 		for (Node *current = begin.leaf(); current; current = current->parent)
 		{
@@ -533,12 +1035,12 @@ public:
 		{
 			LeafNode *current = static_cast<LeafNode *>(stack[0]);
 			for (uint8_t i = 0; i < current->count; ++i)
-				current->keys[i] = current->subs[i]->value.size();
+				current->key(i) = current->get(i)->value.size();
 			int l = 1;
 			for (; l < stack.size(); ++l)
 			{
 				uint8_t index = stack[l - 1]->index;
-				stack[l]->keys[index] = AddSummarizer<K>()(stack[l - 1]->keys.data(), stack[l - 1]->count);
+				stack[l]->keys[index] = this->summarize(stack[l - 1]);
 				if (index + 1 < stack[l]->count)
 				{
 					stack[l - 1] = static_cast<InternalNode *>(stack[l])->subs[index + 1];
@@ -550,7 +1052,7 @@ public:
 				for (++l; l < stack.size(); ++l)
 				{
 					uint8_t index = stack[l - 1]->index;
-					stack[l]->keys[index] = AddSummarizer<K>()(stack[l - 1]->keys.data(), stack[l - 1]->count);
+					stack[l]->keys[index] = this->summarize(stack[l - 1]);
 				}
 				break;
 			}
@@ -561,37 +1063,104 @@ public:
 
 	void update(Iterator it)
 	{
-		for (Node *current = it.node; current->parent; current = current->parent)
+		if (it.leaf() != finger_leaf)
+			finger_leaf = nullptr;
+		for (Node *current = it.leaf(); current->parent; current = current->parent)
 		{
-			K new_key = AddSummarizer<K>()(current->keys.data(), current->count);
+			K new_key = this->summarize(current);
 			if (new_key != current->parent->keys[current->index])
 				current->parent->keys[current->index] = new_key;
 			else
 				break;
 		}
 	}
+
+private:
+	template <size_t Metric>
+	static size_t metricOf(const K &key)
+	{
+		return reinterpret_cast<const size_t *>(&key)[Metric];
+	}
+
+	// climbs from the finger leaf to the lowest node whose subtree contains pos, taking the keys of the
+	// siblings left of each node off offset so it stays where the current subtree begins. stopping below
+	// the root is a hit. without a finger, or when no child of the root contains pos, the search starts
+	// at the root with offset at zero and counts as a miss
+	template <size_t Metric>
+	Node *climbFinger(size_t pos, K &offset) const
+	{
+		if (finger_leaf == nullptr)
+		{
+			++finger_misses;
+			return this->root;
+		}
+		Node *current = finger_leaf;
+		offset = finger_offset;
+		for (; current->parent; current = current->parent)
+		{
+			size_t begin = metricOf<Metric>(offset);
+			size_t size = metricOf<Metric>(current->parent->keys[current->index]);
+			if (begin <= pos && pos - begin < size)
+			{
+				++finger_hits;
+				return current;
+			}
+			for (uint8_t i = 0; i < current->index; ++i)
+				offset -= current->parent->keys[i];
+		}
+		++finger_misses;
+		return current;
+	}
+
+	// search keys in [begin, begin + count), returns index relative to begin
+	template <size_t Metric, typename Keys>
+	static uint8_t searchMetric(const Keys &keys, uint8_t begin, uint8_t count, size_t pos, K &accumulated)
+	{
+		static_assert(sizeof(K) % sizeof(size_t) == 0 && Metric < sizeof(K) / sizeof(size_t));
+		size_t base = reinterpret_cast<const size_t *>(&accumulated)[Metric];
+		uint8_t index;
+		if constexpr (MetricKey<K>)
+		{
+			index = prefixSearch<1, 0>(keys.metrics[Metric].data() + begin, count, pos - base);
+			accumulated += keys.sum(begin, begin + index);
+		}
+		else
+		{
+			const size_t *metrics = reinterpret_cast<const size_t *>(keys.data() + begin);
+			index = prefixSearch<sizeof(K) / sizeof(size_t), Metric>(metrics, count, pos - base);
+			for (uint8_t i = begin; i < begin + index; ++i)
+				accumulated += keys[i];
+		}
+		return index;
+	}
 };
 
 template <typename T>
 struct MaxSummarizer
 {
-	T operator()(const T *keys, size_t count) const
+	template <typename Keys>
+	T operator()(const Keys &keys, size_t count) const
 	{
 		return keys[count - 1];
 	}
 };
 
-template <typename V, uint8_t N>
-class OrderedSet : public BPlusTree<V *, KeyOnlyLeafNode<V, 2 * N - 1>, N, MaxSummarizer<V *>>
+template <typename V, uint8_t N, typename Allocator = ArenaAllocator>
+class OrderedSet : public BPlusTree<V *, KeyOnlyLeafNode<V, 2 * N - 1>, N, MaxSummarizer<V *>, Allocator>
 {
 protected:
-	using Base = BPlusTree<V *, KeyOnlyLeafNode<V, 2 * N - 1>, N, MaxSummarizer<V *>>;
+	using Base = BPlusTree<V *, KeyOnlyLeafNode<V, 2 * N - 1>, N, MaxSummarizer<V *>, Allocator>;
 	using Node = typename Base::Node;
 	using InternalNode = typename Base::InternalNode;
 	using LeafNode = typename Base::LeafNode;
 
 public:
 	OrderedSet() {}
+	template <std::forward_iterator It>
+	OrderedSet(It begin, It end)
+	{
+		build(begin, end);
+	}
 	~OrderedSet() {}
 
 	using Iterator = PinnedIter<V, LeafNode>;
@@ -611,7 +1180,7 @@ public:
 	{
 		Node *current = this->root;
 		size_t index = 0;
-		while (1)
+		while (!current->is_leaf)
 		{
 			auto it = std::lower_bound(
 				current->keys.data(), current->keys.data() + current->count, key,
@@ -622,20 +1191,51 @@ public:
 			index = it - current->keys.data();
 			if (index >= current->count)
 				return end();
-			if (current->is_leaf)
-				break;
 			current = static_cast<InternalNode *>(current)->subs[index];
 		}
-		return Iterator(static_cast<LeafNode *>(current), static_cast<uint8_t>(index));
+		// binary search by logical index, skipping the gap
+		LeafNode *leaf = static_cast<LeafNode *>(current);
+		uint8_t low = 0, high = leaf->count;
+		while (low < high)
+		{
+			uint8_t mid = (low + high) / 2;
+			if (cmp(*leaf->key(mid), key))
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		if (low >= leaf->count)
+			return end();
+		return Iterator(leaf, low);
+	}
+
+	// bulk load an empty set from values sorted by the comparator of later inserts, O(n)
+	template <std::forward_iterator It>
+	void build(It begin, It end)
+	{
+		this->bulkLoad(std::distance(begin, end), [this, &begin](LeafNode *leaf, uint8_t slot)
+		{
+			leaf->set(slot, this->alloc.template create<typename LeafNode::Cell>(*begin++));
+		});
 	}
 
 	template <typename Compare = std::less<V>>
 	Iterator insert(V value, const Compare &cmp = Compare())
 	{
 		auto it = find(value, cmp);
-		auto *cell = new LeafNode::Cell(std::move(value));
+		auto *cell = this->alloc.template create<typename LeafNode::Cell>(std::move(value));
 		auto base_it = it.toBaseIter();
 		base_it = this->insertLeaf(base_it.node, base_it.index, cell);
 		return Iterator(base_it.node, base_it.index);
 	}
+
+	// removes the value at it, returns the iterator after it
+	Iterator erase(Iterator it)
+	{
+		Iterator next = it;
+		++next;
+		auto base_it = it.toBaseIter();
+		this->eraseLeaf(base_it.node, base_it.index);
+		return next;
+	}
 };
@@ -3,56 +3,58 @@
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <memory>
+#include <string_view>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 #include <utf8cpp/utf8.h>
 #include <utility>
 #include <vector>
 
+#include "chunkedindex.hpp"
 #include "crdt.hpp"
 #include "gb+tree.hpp"
+#include "stamptable.hpp"
 #include "taggedptr.hpp"
+#include "utf8scan.hpp"
 
 struct Replica;
 struct Segment;
 struct Piece;
 
+// the total order of ops: by Lamport stamp, then by the rank of the replica
+inline uint64_t orderKey(uint32_t stamp, uint32_t rank)
+{
+	return static_cast<uint64_t>(stamp) << 32 | rank;
+}
+
 struct StoredOperation
 {
-	const Replica *replica{nullptr};
-	uint32_t stamp{0};
+	uint64_t key{0};	 // see orderKey(), the rank part is updated when replicas are ranked again
+	uint32_t replica{0}; // index in the ReplicaTable of the document
 	OperationType type;
 	bool has_undo{false};
+	bool appended{false}; // an insertion stored as StoredAppend
 
+	// not virtual, ops are owned by the arena of their type in Replica and destroyed there
 	StoredOperation(OperationType type)
 		: type(type) {}
 
-	bool operator<(const StoredOperation &other) const;
-};
-
-struct Replica
-{
-	ReplicaID id{};
-	mutable std::vector<std::unique_ptr<StoredOperation>> segments; // created segments
-
-	bool operator<(const Replica &other) const
+	uint32_t stamp() const
 	{
-		return id < other.id;
+		return static_cast<uint32_t>(key >> 32);
 	}
-	bool operator<(const ReplicaID &other) const
+
+	bool operator<(const StoredOperation &other) const
 	{
-		return id < other;
+		return key < other.key;
 	}
 };
 
-bool StoredOperation::operator<(const StoredOperation &other) const
-{
-	if (stamp != other.stamp)
-		return stamp < other.stamp;
-	return replica->id < other.replica->id;
-}
-
 struct StoredDeletion;
 // Text is stored in segments. Whenever text is inserted, a new segment is created,
 // and the target segment with the insertion offset is stored, keeping the target unchanged.
@@ -63,23 +65,104 @@ struct Segment : public StoredOperation
 	Piece *last_piece{nullptr};
 	Piece *insert_piece{nullptr};
 	mutable std::vector<Segment *> split_child; // as segments are usually small, vector is faster
-	std::unique_ptr<const char[]> data{nullptr};
+	mutable ChunkedIndex<Piece *> pieces;		 // non-empty pieces by seg_pos, empty while there is one
+	const char *data{nullptr}; // byte_length bytes, usually in the TextArena of the replica
 	StoredDeletion *undo_op{nullptr};
-
-	Segment(const std::string &str)
-		: StoredOperation(OperationType::Insert)
+	size_t length{0};	  // in code points
+	size_t own_length{0}; // inserted by the op itself, typing appended later follows it
+	size_t byte_length{0};
+	size_t newlines{0};
+	bool ascii{true};
+	std::vector<size_t> checkpoints; // byte offset of every Checkpoint_Step-th code point, empty if ascii
+
+	static constexpr size_t Checkpoint_Step = 64;
+
+	// the text is referenced, not copied, it must outlive the segment
+	Segment(std::string_view str)
+		: Segment(str, utf8Scan(str.data(), str.size())) {}
+
+	// str must be valid UTF-8 as reported by scan
+	Segment(std::string_view str, const Utf8Scan &scan)
+		: StoredOperation(OperationType::Insert),
+		  data(str.data()),
+		  length(scan.length),
+		  own_length(scan.length),
+		  byte_length(str.size()),
+		  newlines(scan.newlines),
+		  ascii(scan.ascii)
 	{
-		data = std::make_unique<const char[]>(str.size() + 1);
-		memcpy(const_cast<char *>(data.get()), str.c_str(), str.size() + 1);
+		assert(scan.valid);
+		if (!ascii)
+			addCheckpoints(0, 0);
 	}
 	~Segment() = default;
 
-	size_t len() const;
+	// typed text, str has to follow the bytes of the segment
+	void append(std::string_view str, const Utf8Scan &scan)
+	{
+		assert(scan.valid && str.data() == data + byte_length);
+		size_t begin = byte_length, pos = length;
+		if (ascii && !scan.ascii)
+			begin = pos = 0; // no checkpoints were kept so far
+		length += scan.length;
+		byte_length += str.size();
+		newlines += scan.newlines;
+		ascii = ascii && scan.ascii;
+		if (!ascii)
+			addCheckpoints(begin, pos);
+	}
+
+	size_t len() const
+	{
+		return length;
+	}
+
+	// byte offset of the code point at char_pos, char_pos == len() gives the size in bytes
+	size_t byteOffset(size_t char_pos) const
+	{
+		if (ascii)
+			return char_pos;
+		if (char_pos == length)
+			return byte_length;
+		const char *ptr = data + checkpoints[char_pos / Checkpoint_Step];
+		utf8::advance(ptr, char_pos % Checkpoint_Step, data + byte_length);
+		return ptr - data;
+	}
 
 	Segment(Segment &&other) noexcept = default;
 	Segment &operator=(Segment &&other) noexcept = default;
 	Segment(const Segment &other) = delete;
 	Segment &operator=(const Segment &other) = delete;
+
+private:
+	// from byte i, the code point pos, code points begin at every byte that is not a continuation byte
+	void addCheckpoints(size_t i, size_t pos)
+	{
+		checkpoints.reserve(length / Checkpoint_Step + 1);
+		for (; i < byte_length; ++i)
+		{
+			if ((static_cast<unsigned char>(data[i]) & 0xc0) == 0x80)
+				continue;
+			if (pos++ % Checkpoint_Step == 0)
+				checkpoints.push_back(i);
+		}
+	}
+};
+
+// typing that continued the latest insertion of its replica at the same place. the text is
+// appended to the segment of that insertion, the op only keeps where its part begins
+struct StoredAppend : public StoredOperation
+{
+	Segment *seg;
+	size_t pos;
+	size_t len;
+	StoredDeletion *undo_op{nullptr};
+
+	StoredAppend(Segment *seg, size_t pos, size_t len)
+		: StoredOperation(OperationType::Insert), seg(seg), pos(pos), len(len)
+	{
+		appended = true;
+	}
 };
 
 struct StoredAnchor
@@ -116,6 +199,10 @@ struct RangeTag
 	StoredAnchor anchor;
 	StoredRangeOp *cur{nullptr};
 	StatedPtr<StoredRangeOp> old{}; // bad status for unused, nullptr for initial status
+	// only used by BoundaryTags: the piece beginning at anchor, and the tags of the same boundary
+	Piece *piece{nullptr};
+	RangeTag *prev{nullptr};
+	RangeTag *next{nullptr};
 
 	RangeTag(bool is_left, const StoredAnchor &anchor, StoredRangeOp *cur)
 		: is_left(is_left), anchor(anchor), cur(cur) {}
@@ -130,6 +217,21 @@ struct StoredRangeOp : public StoredOperation
 		: StoredOperation(type) {}
 };
 
+// order of two tags with the same anchor
+inline bool boundaryBefore(const RangeTag &a, const RangeTag &b)
+{
+	// new right tag-----  -----new left tag
+	// old right tag--- |  | ---old left tag
+	//  (prev piece]  | |  | |  [next piece)
+	// -------------------------- covered old range op
+	if (a.is_left != b.is_left)
+		return b.is_left;
+	else if (a.is_left)
+		return *b.cur < *a.cur;
+	else
+		return *a.cur < *b.cur;
+}
+
 struct StoredDeletion : public StoredRangeOp
 {
 	bool value{true};
@@ -164,8 +266,136 @@ struct StoredRedo : public StoredOperation
 		: StoredOperation(OperationType::Redo), target(target) {}
 };
 
+struct Replica
+{
+	ReplicaID id{};
+	uint32_t index{0}; // dense, in the order replicas became known to the document
+	uint32_t rank{0};  // ordered like id among the replicas of the document, with gaps for new ones
+	mutable StampTable<StoredOperation> ops; // created ops by stamp
+	mutable ObjectArena<Segment> segments;	 // each op type in its own arena, in the order of arrival
+	mutable ObjectArena<StoredAppend> appends;
+	mutable ObjectArena<StoredDeletion> deletions; // with the ones derived for undone insertions
+	mutable ObjectArena<StoredUndo> undos;
+	mutable ObjectArena<StoredRedo> redos;
+	mutable TextArena text;			  // text of the segments, in the order of insertion
+	mutable Segment *typing{nullptr}; // holds the text of its latest op if that was an insertion
+
+	Replica(const ReplicaID &id, uint32_t index) : id(id), index(index) {}
+
+	template <typename T>
+	ObjectArena<T> &arena() const
+	{
+		if constexpr (std::is_same_v<T, Segment>)
+			return segments;
+		else if constexpr (std::is_same_v<T, StoredAppend>)
+			return appends;
+		else if constexpr (std::is_same_v<T, StoredDeletion>)
+			return deletions;
+		else if constexpr (std::is_same_v<T, StoredUndo>)
+			return undos;
+		else
+		{
+			static_assert(std::is_same_v<T, StoredRedo>, "no arena for this op type");
+			return redos;
+		}
+	}
+
+	// after rank changed, one sweep over each arena
+	void rekey() const
+	{
+		auto update = [this](StoredOperation &op)
+		{
+			op.key = orderKey(op.stamp(), rank);
+		};
+		segments.forEach(update);
+		appends.forEach(update);
+		deletions.forEach(update);
+		undos.forEach(update);
+		redos.forEach(update);
+	}
+};
+
+// interns the ReplicaIDs of a document into dense indices. ops of one replica usually arrive in
+// runs, the latest lookup is remembered before the hash map is asked.
+// ranks follow the order of ids, so comparing order keys agrees with every other document. a joining
+// replica takes the middle of the gap between its neighbours, only a full gap ranks all of them again
+class ReplicaTable
+{
+private:
+	static constexpr uint64_t Rank_Range = uint64_t(1) << 32;
+
+	std::vector<std::unique_ptr<Replica>> replicas; // by index, replicas never move
+	std::vector<Replica *> by_id;
+	std::unordered_map<ReplicaID, uint32_t, ReplicaIDHash> indices;
+	mutable Replica *last{nullptr};
+	size_t rerank_count{0};
+
+	void rank(std::vector<Replica *>::iterator it)
+	{
+		uint64_t low = it == by_id.begin() ? 0 : it[-1]->rank + uint64_t(1);
+		uint64_t high = it + 1 == by_id.end() ? Rank_Range : it[1]->rank;
+		if (low < high)
+		{
+			(*it)->rank = static_cast<uint32_t>((low + high) / 2);
+			return;
+		}
+		uint64_t step = Rank_Range / (by_id.size() + 1);
+		for (size_t i = 0; i < by_id.size(); ++i)
+		{
+			by_id[i]->rank = static_cast<uint32_t>((i + 1) * step);
+			by_id[i]->rekey();
+		}
+		++rerank_count;
+	}
+
+public:
+	size_t size() const { return replicas.size(); }
+	size_t rerankCount() const { return rerank_count; }
+
+	Replica *operator[](uint32_t index) const
+	{
+		return replicas[index].get();
+	}
+
+	// nullptr if the replica has no stored ops
+	Replica *find(const ReplicaID &id) const
+	{
+		if (last && last->id == id)
+			return last;
+		auto it = indices.find(id);
+		if (it == indices.end())
+			return nullptr;
+		return last = replicas[it->second].get();
+	}
+
+	Replica *intern(const ReplicaID &id)
+	{
+		if (Replica *replica = find(id))
+			return replica;
+		uint32_t index = static_cast<uint32_t>(replicas.size());
+		indices.emplace(id, index);
+		last = replicas.emplace_back(std::make_unique<Replica>(id, index)).get();
+		auto it = std::lower_bound(by_id.begin(), by_id.end(), id, [](const Replica *a, const ReplicaID &b)
+		{
+			return a->id < b;
+		});
+		rank(by_id.insert(it, last));
+		return last;
+	}
+
+	auto begin() const { return replicas.begin(); }
+	auto end() const { return replicas.end(); }
+};
+
+
 struct PieceInfo
 {
+	// metric indices for Sequence::findMetric, nodes store each metric in its own array
+	static constexpr bool metric_layout = true;
+	static constexpr size_t Total = 0;
+	static constexpr size_t Visible = 1;
+	using NodeState = StoredRangeOp *; // lazy tombstone of an internal node, see PieceTree::coverChildren
+
 	size_t total{0};
 	size_t visible{0};
 
@@ -190,9 +420,10 @@ struct PieceInfo
 		return visible != other.visible || total != other.total;
 	}
 };
+static_assert(offsetof(PieceInfo, total) == PieceInfo::Total * sizeof(size_t));
+static_assert(offsetof(PieceInfo, visible) == PieceInfo::Visible * sizeof(size_t));
 
 // Segments are split into pieces according to global offsets.
-// TODO: limit the length of piece, as the split operation is O(n) in the length of piece.
 struct Piece
 {
 	Segment *seg{nullptr};
@@ -200,13 +431,17 @@ struct Piece
 	size_t len{0};
 	size_t seg_pos{0};
 	StoredRangeOp *tombStone{nullptr};
+	uint64_t label{0};		   // increases along the tree, maintained by PieceTree
+	RangeTag *tags{nullptr}; // tags anchored at the beginning of this piece, only used by BoundaryTags
 
 	Piece() = default;
 	Piece(Segment *seg)
+		: Piece(seg, 0, seg->len()) {}
+	Piece(Segment *seg, size_t seg_pos, size_t len)
 		: seg(seg),
-		  data(seg->data.get()),
-		  len(utf8::distance(data, data + strlen(data))),
-		  seg_pos(0) {}
+		  data(seg->data + seg->byteOffset(seg_pos)),
+		  len(len),
+		  seg_pos(seg_pos) {}
 
 	bool isRemoved() const
 	{
@@ -218,20 +453,31 @@ struct Piece
 		return {.total = len, .visible = isRemoved() ? 0 : len};
 	}
 
+	// size of data in bytes
+	size_t bytes() const
+	{
+		if (len == 0)
+			return 0; // data of an empty piece isn't kept up to date by PieceTree::relocate()
+		return seg->byteOffset(seg_pos + len) - (data - seg->data);
+	}
+
 	bool operator<(const Piece &other) const
 	{
 		return data < other.data;
 	}
 };
 
-size_t Segment::len() const
-{
-	return last_piece->seg_pos + last_piece->len;
-}
+// in code points, see PieceTree::setMaxPieceLength(). unbounded unless a caller opts in
+constexpr size_t Default_Max_Piece_Len = SIZE_MAX;
 
 template <uint8_t N>
 class PieceTree : public Sequence<PieceInfo, Piece, N>
 {
+private:
+	Piece *coalesce_cursor{nullptr}; // where the next coalesceStep() starts, nullptr for the beginning
+	size_t max_piece_len{Default_Max_Piece_Len};
+	size_t relabel_count{0};
+
 public:
 	using Base = Sequence<PieceInfo, Piece, N>;
 	using Iterator = typename Base::Iterator;
@@ -242,70 +488,83 @@ public:
 	PieceTree(Segment *initial_segment)
 	{
 		auto it = this->insertBefore(this->end(), Piece(initial_segment));
+		it->label = Label_Space / 2;
 		initial_segment->last_piece = &*it;
 	}
 
+	size_t relabelCount() const { return relabel_count; }
+
+	// in code points. insertions longer than this are stored as a chain of pieces, and coalescing never
+	// grows a piece beyond it. edits into a huge paste cost about the same either way since the segment's
+	// piece index is chunked, so this only helps callers that read or copy whole pieces
+	void setMaxPieceLength(size_t len)
+	{
+		assert(len > 0);
+		max_piece_len = len;
+	}
+
+	size_t maxPieceLength() const
+	{
+		return max_piece_len;
+	}
+
+	// visible pieces only, iteration cost follows the visible pieces rather than the whole history
+	Iterator beginVisible() const
+	{
+		return visibleFrom(this->begin());
+	}
+
+	Iterator nextVisible(Iterator it) const
+	{
+		Iterator next = it;
+		if (++next == this->end() || next.leaf() == it.leaf())
+			return this->template skipEmpty<PieceInfo::Visible>(next);
+		return visibleFrom(next);
+	}
+
+	// the total metric may descend below lazy tombstones, the piece is settled before it is returned
 	Iterator findHistory(size_t history_pos)
 	{
-		return Base::find(history_pos, [](size_t a, const PieceInfo &b)
-		{
-			return a < b.total;
-		});
+		Iterator it = this->template findMetric<PieceInfo::Total>(history_pos);
+		if (pending == 0 || it == this->end())
+			return it;
+		settle(it);
+		return Iterator(&*it);
 	}
 
 	Iterator find(size_t file_pos)
 	{
-		return Base::find(file_pos, [](size_t a, const PieceInfo &b)
-		{
-			return a < b.visible;
-		});
+		return this->template findMetric<PieceInfo::Visible>(file_pos);
 	}
 
 	Iterator find(const StoredAnchor &anchor)
 	{
-		Segment *seg = anchor.seg;
+		return Iterator(pieceAt(anchor));
+	}
 
-		auto seg_it = std::lower_bound(
-			seg->split_child.begin(), seg->split_child.end(), anchor.pos,
-			[](const Segment *p, size_t position)
-		{
-			return p->insert_pos <= position;
-		});
-		Piece *piece = seg->last_piece;
-		if (seg_it < seg->split_child.end())
-			piece = (*seg_it)->insert_piece;
-		assert(piece->seg == seg);
-		auto it = Iterator(piece);
-		if (piece->seg_pos <= anchor.pos)
-			return it;
-		it = findHistory(it.position().total + anchor.pos - piece->seg_pos);
-		assert(it->seg == seg);
-		return it;
+	// the piece containing anchor, same as find(anchor) but its position is only computed when needed.
+	// searches the piece index of the segment, empty pieces left by split() are never returned
+	static Piece *pieceAt(const StoredAnchor &anchor)
+	{
+		const auto &pieces = anchor.seg->pieces;
+		if (pieces.empty())
+			return anchor.seg->last_piece;
+		return pieces.floor(anchor.pos);
 	}
 
-	Anchor historyAnchor(size_t pos)
+	StoredAnchor historyAnchor(size_t pos)
 	{
 		Iterator it = findHistory(pos);
 		assert(it != this->end());
-		Segment *seg = it->seg;
-		Anchor anchor;
-		anchor.replica = seg->replica->id;
-		anchor.stamp = seg->stamp;
-		anchor.pos = pos - it.position().total + it->seg_pos;
-		return anchor;
+		return StoredAnchor(it->seg, pos - it.position().total + it->seg_pos);
 	}
 
-	Anchor anchor(size_t pos)
+	StoredAnchor anchor(size_t pos)
 	{
 		Iterator it = find(pos);
 		assert(it != this->end());
 		assert(it->tombStone == nullptr);
-		Segment *seg = it->seg;
-		Anchor anchor;
-		anchor.replica = seg->replica->id;
-		anchor.stamp = seg->stamp;
-		anchor.pos = pos - it.position().visible + it->seg_pos;
-		return anchor;
+		return StoredAnchor(it->seg, pos - it.position().visible + it->seg_pos);
 	}
 
 	size_t historyOffset(const StoredAnchor &anchor)
@@ -327,9 +586,7 @@ public:
 		{
 			if (a->insert_pos != b->insert_pos)
 				return a->insert_pos < b->insert_pos;
-			if (a->stamp != b->stamp)
-				return a->stamp < b->stamp;
-			return a->replica->id < b->replica->id;
+			return *a < *b;
 		});
 		// handle insertion ambiguity
 		if (pos == 0 && parent->split_child.size() > 0)
@@ -360,34 +617,393 @@ public:
 		}
 		segment->insert_piece = &*it;
 		parent->split_child.insert(conflict_it, segment);
+		Iterator next = it;
+		settle(++next); // the new piece goes into the leaf of next
 
-		Piece new_node(segment);
-		auto new_it = this->insertAfter(it, new_node);
-		segment->last_piece = &*new_it;
+		Iterator first = insertChunks(it, segment, 0, segment->len());
 
 		// TODO: get all ranges
-		return new_it;
+		return first;
+	}
+
+	// text typed onto the end of segment from pos on, right after its last piece
+	void append(Segment *segment, size_t pos, size_t len)
+	{
+		Iterator it(segment->last_piece);
+		Iterator next = it;
+		settle(++next);
+		settle(it);
+		if (it->tombStone == nullptr && it->len + len <= max_piece_len)
+		{
+			it->len += len;
+			it.key() = it->size();
+			this->update(it);
+			return;
+		}
+		if (segment->pieces.empty())
+			segment->pieces.push_back(it->seg_pos, &*it);
+		insertChunks(it, segment, pos, len);
+	}
+
+	// the bytes of segment moved to data, pieces follow them
+	void relocate(Segment *segment, const char *data)
+	{
+		auto move = [&](Piece *piece)
+		{
+			piece->data = data + (piece->data - segment->data);
+		};
+		if (segment->pieces.empty())
+			move(segment->last_piece);
+		segment->pieces.forEach(move);
+		segment->data = data;
+	}
+
+	// removes [first, last) by op where op is newer than the current tombstone.
+	// subtrees between the two boundary paths are covered lazily, so this is O(log n) pieces and nodes
+	void cover(Iterator first, Iterator last, StoredRangeOp *op)
+	{
+		if (first == last)
+			return;
+		auto begin = first.toBaseIter(), end = last.toBaseIter();
+		settle(begin.node);
+		settle(end.node);
+		this->finger_leaf = nullptr;
+		if (begin.node == end.node)
+			coverLeaf(begin.node, begin.index, end.index, op);
+		else
+		{
+			coverLeaf(begin.node, begin.index, begin.node->count, op);
+			coverLeaf(end.node, 0, end.index, op);
+			Node *left = begin.node, *right = end.node;
+			for (; left->parent != right->parent; left = left->parent, right = right->parent)
+			{
+				coverChildren(left->parent, left->index + 1, left->parent->count, op);
+				coverChildren(right->parent, 0, right->index, op);
+			}
+			coverChildren(left->parent, left->index + 1, right->index, op);
+		}
+		summarizePath(begin.node);
+		summarizePath(end.node);
+	}
+
+	// pushes lazy tombstones down to the piece at it, it can be read and modified afterwards
+	void settle(Iterator it)
+	{
+		settle(it.toBaseIter().node);
+	}
+
+	// settles every piece in [first, last]
+	void settle(Iterator first, Iterator last)
+	{
+		if (pending == 0)
+			return;
+		for (LeafNode *leaf = first.toBaseIter().node, *end = last.toBaseIter().node;; leaf = leaf->next.asNormal())
+		{
+			settle(leaf);
+			if (leaf == end)
+				break;
+		}
+	}
+
+	void settleAll()
+	{
+		if (pending != 0 && !this->root->is_leaf)
+			settleBelow(static_cast<InternalNode *>(this->root));
+	}
+
+	// returns the piece beginning at anchor, splits the piece containing it if needed
+	Iterator cut(const StoredAnchor &anchor)
+	{
+		Iterator it = find(anchor);
+		size_t pos = anchor.pos - it->seg_pos;
+		if (pos != 0)
+			it = ++split(it, pos);
+		return it;
+	}
+
+	// consecutive parts of one segment with the same tombstone, tags in a RangeTree don't pin the boundary
+	// between them as range walks cut() at every tag first, tags attached to the right piece do.
+	// chunks of a long insertion stay apart
+	bool adjacent(const Piece &left, const Piece &right) const
+	{
+		return left.seg == right.seg && left.seg_pos + left.len == right.seg_pos &&
+			   left.tombStone == right.tombStone && right.tags == nullptr &&
+			   left.len + right.len <= max_piece_len;
+	}
+
+	// merges every adjacent pair, returns the number of pieces removed
+	size_t coalesce()
+	{
+		size_t before = this->size();
+		for (Iterator it = this->begin(); it != this->end();)
+			it = coalesceAt(it);
+		return before - this->size();
+	}
+
+	// incremental coalesce(), visits at most `budget` pieces and resumes there on the next call
+	size_t coalesceStep(size_t budget)
+	{
+		size_t before = this->size();
+		Iterator it = coalesce_cursor ? Iterator(coalesce_cursor) : this->begin();
+		for (; budget > 0 && it != this->end(); --budget)
+			it = coalesceAt(it);
+		coalesce_cursor = it == this->end() ? nullptr : &*it;
+		return before - this->size();
+	}
+
+	// merges it into the next piece if they are adjacent, returns the iterator after it
+	Iterator coalesceAt(Iterator it)
+	{
+		Iterator next = it;
+		++next;
+		if (next == this->end())
+			return next;
+		settle(next);
+		settleSiblings(it.leaf()); // erasing may borrow from or merge with siblings at every level
+		if (!adjacent(*it, *next))
+			return next;
+		// a segment inserted at the boundary would lie between the two pieces, so last_piece and
+		// insert_piece never point to the left one, it can be erased and the right one grows over it
+		if (coalesce_cursor == &*it)
+			coalesce_cursor = &*next;
+		Piece left = *it;
+		if (left.len > 0)
+		{
+			// the right piece takes over the entry of the left one, an empty one isn't indexed yet
+			auto &pieces = left.seg->pieces;
+			assert(pieces.floor(left.seg_pos) == &*it);
+			if (next->len > 0)
+				pieces.erase(next->seg_pos);
+			pieces.replace(left.seg_pos, &*next);
+		}
+		next = this->erase(it);
+		next->data = left.data;
+		next->seg_pos = left.seg_pos;
+		next->len += left.len;
+		next->tags = left.tags;
+		for (RangeTag *tag = next->tags; tag; tag = tag->next)
+			tag->piece = &*next;
+		next.key() = next->size();
+		this->update(next);
+		return next;
 	}
 
 	// return the left part, creates new piece even if pos == 0
 	Iterator split(Iterator it, size_t pos)
 	{
 		assert(pos < it->len);
-
-		size_t offset = 0;
-		const char *ptr = it->data;
-		utf8::advance(ptr, pos, ptr + 4 * it->len); // max 4 bytes per utf8 char
-		offset = ptr - it->data;
+		settle(it);
 
 		// new node is the left part
 		Piece new_node = *it;
 		new_node.len = pos;
-		it->data += offset;
+		it->data = it->seg->data + it->seg->byteOffset(it->seg_pos + pos);
 		it->seg_pos += pos;
 		it->len -= pos;
 		it.key() = it->size(); // no need to update(), insertBefore() will do it
 
-		return this->insertBefore(it, new_node);
+		it->tags = nullptr; // tags at the beginning move to the left part
+
+		auto left = this->insertBefore(it, new_node);
+		assignLabel(left);
+		// an empty left part contains no anchor and stays out of the piece index
+		if (pos > 0)
+		{
+			// the left part takes over the entry of the piece, which is indexed again at its new seg_pos
+			auto &pieces = it->seg->pieces;
+			if (pieces.empty())
+				pieces.push_back(left->seg_pos, &*left);
+			else
+			{
+				assert(pieces.floor(left->seg_pos) == &*it);
+				pieces.replace(left->seg_pos, &*left);
+			}
+			pieces.insert(it->seg_pos, &*it);
+		}
+		for (RangeTag *tag = left->tags; tag; tag = tag->next)
+			tag->piece = &*left;
+		return left;
+	}
+
+private:
+	// order-maintenance labels (Bender et al. variant of Dietz-Sleator): pieces compare by label in O(1).
+	// a full range of 2^i labels holds at most (2 / Label_Density)^i pieces before its parent range is spread
+	static constexpr int Label_Bits = 62;
+	static constexpr uint64_t Label_Space = uint64_t(1) << Label_Bits;
+	static constexpr double Label_Density = 1.4;
+
+	// [pos, pos + len) of segment after it, in pieces of at most max_piece_len. pieces of a segment
+	// longer than that are indexed, so anchors resolve to the chunk holding them. returns the first one
+	Iterator insertChunks(Iterator it, Segment *segment, size_t pos, size_t len)
+	{
+		Iterator first = this->end();
+		for (size_t end = pos + len, chunk_len; first == this->end() || pos < end; pos += chunk_len)
+		{
+			chunk_len = std::min(max_piece_len, end - pos);
+			it = this->insertAfter(it, Piece(segment, pos, chunk_len));
+			assignLabel(it);
+			if (!segment->pieces.empty() || len > max_piece_len)
+				segment->pieces.push_back(pos, &*it);
+			if (first == this->end())
+				first = it;
+		}
+		segment->last_piece = &*it;
+		return first;
+	}
+
+	// internal nodes holding a lazy tombstone in their state: every piece below is removed by at least
+	// that op. the key of such a node in its parent is exact, keys inside it are not until it is pushed down
+	size_t pending{0};
+
+	static void bury(Piece &piece, StoredRangeOp *op)
+	{
+		if (piece.tombStone == nullptr || *piece.tombStone < *op)
+			piece.tombStone = op;
+	}
+
+	void coverLeaf(LeafNode *leaf, uint8_t begin, uint8_t end, StoredRangeOp *op)
+	{
+		for (uint8_t i = begin; i < end; ++i)
+		{
+			Piece &piece = leaf->get(i)->value;
+			bury(piece, op);
+			leaf->key(i) = piece.size();
+		}
+	}
+
+	// children in [begin, end) of node become invisible, leaves at once and internal nodes lazily
+	void coverChildren(InternalNode *node, uint8_t begin, uint8_t end, StoredRangeOp *op)
+	{
+		for (uint8_t i = begin; i < end; ++i)
+		{
+			PieceInfo key = node->keys[i];
+			key.visible = 0;
+			node->keys[i] = key;
+			Node *child = node->subs[i];
+			if (child->is_leaf)
+				coverLeaf(static_cast<LeafNode *>(child), 0, child->count, op);
+			else
+			{
+				StoredRangeOp *&lazy = static_cast<InternalNode *>(child)->state;
+				pending += lazy == nullptr;
+				if (lazy == nullptr || *lazy < *op)
+					lazy = op;
+			}
+		}
+	}
+
+	void pushDown(InternalNode *node)
+	{
+		StoredRangeOp *op = node->state;
+		if (op == nullptr)
+			return;
+		node->state = nullptr;
+		--pending;
+		this->finger_leaf = nullptr; // offsets below node change
+		coverChildren(node, 0, node->count, op);
+	}
+
+	// pushes down every lazy tombstone in the subtree of node
+	void settleBelow(InternalNode *node)
+	{
+		pushDown(node);
+		for (uint8_t i = 0; pending != 0 && i < node->count; ++i)
+			if (!node->subs[i]->is_leaf)
+				settleBelow(static_cast<InternalNode *>(node->subs[i]));
+	}
+
+	// pushes down lazy tombstones of all ancestors, top-down
+	void settle(Node *node)
+	{
+		if (pending == 0)
+			return;
+		InternalNode *path[64];
+		int depth = 0;
+		for (InternalNode *current = node->parent; current; current = current->parent)
+			path[depth++] = current;
+		while (depth > 0)
+			pushDown(path[--depth]);
+	}
+
+	// settles node and the siblings of node and its ancestors, which rebalancing may touch
+	void settleSiblings(Node *node)
+	{
+		settle(node);
+		for (Node *current = node->parent; current && current->parent; current = current->parent)
+		{
+			InternalNode *parent = current->parent;
+			if (current->index > 0)
+				pushDown(static_cast<InternalNode *>(parent->subs[current->index - 1]));
+			if (current->index + 1 < parent->count)
+				pushDown(static_cast<InternalNode *>(parent->subs[current->index + 1]));
+		}
+	}
+
+	void summarizePath(Node *node)
+	{
+		for (; node->parent; node = node->parent)
+			node->parent->keys[node->index] = this->summarize(node);
+	}
+
+	// skipEmpty() from it, the first piece of its leaf. keys below a lazy tombstone are stale,
+	// so the highest covered ancestor is skipped by its exact key in the parent instead
+	Iterator visibleFrom(Iterator it) const
+	{
+		InternalNode *covered = nullptr;
+		if (pending != 0 && it != this->end())
+			for (InternalNode *node = it.leaf()->parent; node && node->parent; node = node->parent)
+				if (node->state != nullptr)
+					covered = node;
+		if (covered == nullptr)
+			return this->template skipEmpty<PieceInfo::Visible>(it);
+		InternalNode *parent = covered->parent;
+		return this->template skipEmpty<PieceInfo::Visible>(parent, covered->index + 1,
+															it.position() + parent->keys[covered->index]);
+	}
+
+	// labels the new piece at it, relabels the smallest enclosing range that is sparse enough if
+	// the neighbours leave no room
+	void assignLabel(Iterator it)
+	{
+		Iterator first = it, last = it;
+		uint64_t low = it == this->begin() ? 0 : (--first)->label + 1;
+		uint64_t high = ++last == this->end() ? Label_Space : last->label;
+		if (low < high)
+		{
+			it->label = low + (high - low) / 2;
+			return;
+		}
+
+		// [first, last] are the pieces with labels inside [base, base + 2^bits)
+		low = std::min(low, Label_Space - 1);
+		first = last = it;
+		size_t count = 1;
+		double capacity = 1;
+		for (int bits = 1; bits <= Label_Bits; ++bits)
+		{
+			capacity *= 2 / Label_Density;
+			uint64_t base = low >> bits << bits;
+			uint64_t end = base + (uint64_t(1) << bits);
+			for (; first != this->begin(); ++count)
+			{
+				Iterator prev = first;
+				if ((--prev)->label < base)
+					break;
+				first = prev;
+			}
+			for (Iterator next = last; ++next != this->end() && next->label < end; ++count)
+				last = next;
+			if (count < capacity || bits == Label_Bits)
+			{
+				uint64_t step = (end - base) / count;
+				assert(step > 0 && "too many pieces for the label space");
+				uint64_t label = base + step / 2;
+				for (++last; first != last; ++first, label += step)
+					first->label = label;
+				++relabel_count;
+				return;
+			}
+		}
 	}
 };
 
@@ -417,15 +1033,11 @@ protected:
 	template <typename PieceTree>
 	auto addTag(RangeTag tag, PieceTree &piece_tree)
 	{
-		auto piece_it = piece_tree.find(tag.anchor);
-		size_t pos = tag.anchor.pos - piece_it->seg_pos;
-		if (pos != 0)
-			piece_it = ++piece_tree.split(piece_it, pos);
-
-		size_t history_pos = piece_it.position().total;
+		auto piece_it = piece_tree.cut(tag.anchor);
+		uint64_t label = piece_it->label;
 
 		auto it = this->insert(std::move(tag),
-							   [&piece_tree, history_pos](const RangeTag &a, const RangeTag &b)
+							   [&piece_tree, label](const RangeTag &a, const RangeTag &b)
 		{
 			if (a.anchor.seg == b.anchor.seg)
 			{
@@ -434,53 +1046,170 @@ protected:
 			}
 			else
 			{
-				size_t a_pos = piece_tree.historyOffset(a.anchor);
-				if (a_pos != history_pos)
-					return a_pos < history_pos;
+				// b begins piece_it, a lies inside another piece, so labels of the pieces decide
+				uint64_t a_label = piece_tree.pieceAt(a.anchor)->label;
+				return a_label < label;
 			}
-			// new right tag-----  -----new left tag
-			// old right tag--- |  | ---old left tag
-			//  (prev piece]  | |  | |  [next piece)
-			// -------------------------- covered old range op
-			if (a.is_left != b.is_left)
-				return b.is_left;
-			else if (a.is_left)
-				return *b.cur < *a.cur;
-			else
-				return *a.cur < *b.cur;
+			return boundaryBefore(a, b);
 		});
 		return std::make_pair(it, piece_it);
 	}
+
+public:
+	// pieces may have been coalesced over tags, restore the boundary of every tag from left to right
+	template <typename PieceTree>
+	void restoreBoundaries(Iterator left_it, Iterator right_it, PieceTree &piece_tree)
+	{
+		for (auto it = left_it;; ++it)
+		{
+			piece_tree.cut(it->anchor);
+			if (it == right_it)
+				break;
+		}
+	}
+
+	// the piece beginning at the anchor of tag, after restoreBoundaries()
+	template <typename PieceTree>
+	auto pieceOf(const RangeTag *tag, PieceTree &piece_tree)
+	{
+		return piece_tree.find(tag->anchor);
+	}
 };
 
-class PieceCRDT
+// range tags attached to the piece beginning at their anchor instead of a separate tree.
+// tags of one boundary form a list in boundaryBefore() order, so walking tags is walking the piece list,
+// and adding a tag needs no descent besides cutting the piece
+template <typename PieceTree>
+class BoundaryTags
+{
+private:
+	using PieceIter = typename PieceTree::Iterator::Base; // no positions needed
+
+	ArenaAllocator alloc; // owns the tags
+
+public:
+	class Iterator
+	{
+		RangeTag *tag{nullptr};
+
+	public:
+		Iterator(RangeTag *tag = nullptr)
+			: tag(tag) {}
+
+		RangeTag &operator*() const { return *tag; }
+		RangeTag *operator->() const { return tag; }
+		bool operator==(const Iterator &other) const { return tag == other.tag; }
+		bool operator!=(const Iterator &other) const { return tag != other.tag; }
+
+		// nullptr after the last tag
+		Iterator &operator++()
+		{
+			if (tag->next)
+			{
+				tag = tag->next;
+				return *this;
+			}
+			PieceIter it(tag->piece);
+			for (++it; it.cell.isNormal() && it->tags == nullptr; ++it)
+				;
+			tag = it.cell.isNormal() ? it->tags : nullptr;
+			return *this;
+		}
+		Iterator &operator--()
+		{
+			if (tag->prev)
+			{
+				tag = tag->prev;
+				return *this;
+			}
+			PieceIter it(tag->piece);
+			for (--it; it->tags == nullptr; --it)
+				;
+			for (tag = it->tags; tag->next; tag = tag->next)
+				;
+			return *this;
+		}
+	};
+
+	BoundaryTags() = default;
+	~BoundaryTags() = default;
+
+	auto apply(RangeTag left, RangeTag right, PieceTree &piece_tree)
+	{
+		// left and right can be on the same piece, so we need to split right first
+		auto end = addTag(right, piece_tree);
+		auto begin = addTag(left, piece_tree);
+		return std::make_pair(begin, end);
+	}
+
+	// tags pin their boundaries, nothing to restore
+	void restoreBoundaries(Iterator, Iterator, PieceTree &) {}
+
+	auto pieceOf(const RangeTag *tag, PieceTree &)
+	{
+		return typename PieceTree::Iterator(tag->piece);
+	}
+
+private:
+	auto addTag(const RangeTag &tag, PieceTree &piece_tree)
+	{
+		auto piece_it = piece_tree.cut(tag.anchor);
+		RangeTag *new_tag = alloc.create<RangeTag>(tag);
+		new_tag->piece = &*piece_it;
+
+		RangeTag *prev = nullptr, *next = piece_it->tags;
+		for (; next && boundaryBefore(*next, *new_tag); next = next->next)
+			prev = next;
+		new_tag->prev = prev;
+		new_tag->next = next;
+		(prev ? prev->next : piece_it->tags) = new_tag;
+		if (next)
+			next->prev = new_tag;
+		return std::make_pair(Iterator(new_tag), piece_it);
+	}
+};
+
+// fanouts are minimum degrees of the trees, nodes hold up to 2 * N - 1 keys.
+// range tags are kept in a RangeTree, or attached to the pieces with AttachTags (BoundaryTags)
+template <uint8_t PieceN = defaultFanout<PieceInfo>(),
+		  uint8_t TagN = defaultFanout<RangeTag *>(),
+		  bool AttachTags = false>
+class BasicPieceCRDT
 {
 private:
 	uint32_t lamport_stamp;
 
 protected:
+	using TagTree = std::conditional_t<AttachTags, BoundaryTags<PieceTree<PieceN>>, RangeTree<bool, TagN>>;
+
 	const ReplicaID local_id;
-	OrderedSet<Replica, 4> replicas;
-	PieceTree<4> piece_tree;
-	RangeTree<bool, 4> deletions;
+	ReplicaTable replicas;
+	PieceTree<PieceN> piece_tree;
+	TagTree deletions;
+	std::vector<std::shared_ptr<const char[]>> buffers; // adopted by insert(), segments reference them
 
 public:
-	PieceCRDT()
+	// code points a segment grows to by typing, see append()
+	static constexpr size_t Max_Typed_Length = 1024;
+
+	BasicPieceCRDT()
 		: lamport_stamp(0),
 		  local_id(uuids::uuid_system_generator{}()),
 		  piece_tree(storeOp<Segment>(local_id, 0, "EOF"))
 	{
 	}
 
-	~PieceCRDT() = default;
+	~BasicPieceCRDT() = default;
 
 	const ReplicaID id() const
 	{
 		return local_id;
 	}
 
+	// pieces are read directly, so lazy tombstones are pushed down first
 	auto begin()
 	{
+		piece_tree.settleAll();
 		return piece_tree.begin();
 	}
 
@@ -494,46 +1223,165 @@ public:
 		return (--piece_tree.end()).position().visible;
 	}
 
+	size_t pieceCount() const
+	{
+		return piece_tree.size();
+	}
+
+	// applies to later insertions, pieces already in the tree keep their length
+	void setMaxPieceLength(size_t len)
+	{
+		piece_tree.setMaxPieceLength(len);
+	}
+
+	// merges pieces split apart by range tags once their tombstones agree again,
+	// returns the number of pieces removed. with AttachTags the tags stay on the piece after
+	// their cut and pin it, so this only merges pieces no deletion has ever cut apart
+	size_t coalesce()
+	{
+		return piece_tree.coalesce();
+	}
+
+	// incremental coalesce() for idle time, visits at most `budget` pieces per call
+	size_t coalesceStep(size_t budget)
+	{
+		return piece_tree.coalesceStep(budget);
+	}
+
 	std::string toString() const
 	{
 		std::string res;
 		res.reserve(size());
-		for (auto it = piece_tree.begin(), end_it = --piece_tree.end(); it != end_it; ++it)
-		{
-			if (it->isRemoved())
-				continue;
-			res.append(it->data, it->len);
-		}
+		// the EOF piece is always visible, so the walk stops at it
+		for (auto it = piece_tree.beginVisible(), end_it = --piece_tree.end(); it != end_it; it = piece_tree.nextVisible(it))
+			res.append(it->data, it->bytes());
 		return res;
 	}
 
 	// anchor at visible position
-	auto anchor(size_t pos)
+	Anchor anchor(size_t pos)
 	{
-		return piece_tree.anchor(pos);
+		return toAnchor(piece_tree.anchor(pos));
 	}
 
-	auto historyAnchor(size_t pos)
+	Anchor historyAnchor(size_t pos)
 	{
-		return piece_tree.historyAnchor(pos);
+		return toAnchor(piece_tree.historyAnchor(pos));
+	}
+
+	// whether an insertion by replica at anchor continues its typing, the flag to send with the op.
+	// the latest op of the replica has to be an insertion at the same place that no later insertion sits
+	// behind. only the author can tell, receivers may hold concurrent insertions it had not seen
+	bool continuesTyping(const ReplicaID &replica_id, const Anchor &anchor)
+	{
+		const Replica *replica = findReplica(replica_id);
+		Segment *segment = replica == nullptr ? nullptr : replica->typing;
+		if (segment == nullptr || toStored(anchor) != StoredAnchor(segment->parent, segment->insert_pos))
+			return false;
+		// split_child is ordered by place, then by op, segment has to end the run at its place
+		const auto &siblings = segment->parent->split_child;
+		auto behind = std::upper_bound(siblings.begin(), siblings.end(), segment->insert_pos,
+									   [](size_t pos, const Segment *sibling)
+		{
+			return pos < sibling->insert_pos;
+		});
+		return behind[-1] == segment;
 	}
 
 	void insert(const Insertion &op)
 	{
-		Segment *segment = storeOp<Segment>(op.replica, op.stamp, op.str);
-		auto anchor = toStored(op.anchor);
-		if (anchor.seg == nullptr)
-			return; // invalid anchor
-		segment->parent = anchor.seg;
-		segment->insert_pos = anchor.pos;
-		piece_tree.insert(segment);
+		insert(InsertionView(op));
+	}
+
+	// the text is copied once, into the arena of the replica, so typing fills it contiguously
+	void insert(const InsertionView &op)
+	{
+		Utf8Scan scan = utf8Scan(op.str.data(), op.str.size());
+		if (!scan.valid)
+			return; // malformed text, offsets into it would not be code points
+		Replica *replica = getReplica(op.replica);
+		if (append(replica, op, scan))
+			return;
+		const char *text = replica->text.append(op.str.data(), op.str.size());
+		insertSegment(storeOp<Segment>(replica, op.stamp, std::string_view(text, op.str.size()), scan), op.anchor);
+	}
+
+	// zero-copy ingest: op.str must lie inside buffer, the segment references it there.
+	// the document shares ownership of every adopted buffer until it is destroyed,
+	// the caller must not modify the bytes afterwards
+	void insert(const InsertionView &op, const std::shared_ptr<const char[]> &buffer)
+	{
+		Utf8Scan scan = utf8Scan(op.str.data(), op.str.size());
+		if (!scan.valid)
+			return; // malformed text, offsets into it would not be code points
+		Replica *replica = getReplica(op.replica);
+		if (append(replica, op, scan))
+			return;
+		if (buffers.empty() || buffers.back() != buffer) // a batch shares one buffer
+			buffers.push_back(buffer);
+		insertSegment(storeOp<Segment>(replica, op.stamp, op.str, scan), op.anchor);
 	}
 
 	void del(const Deletion &op)
 	{
 		auto *stored_op = storeOp<StoredDeletion>(op.replica, op.stamp);
-		auto begin = toStored(op.begin);
-		auto end = toStored(op.end);
+		applyDeletion(stored_op, toStored(op.begin), toStored(op.end));
+	}
+
+	// TODO: op is received from other replicas, do we need to transform it?
+	// we need to ensure not undo/redo an undo/redo operation before send it to other replicas
+	void undo(const UndoOperation &op)
+	{
+		const Replica *replica = findReplica(op.target.replica);
+		if (replica == nullptr)
+			return;
+		StoredOperation *target = replica->ops.get(op.target.stamp);
+		if (target == nullptr || target->has_undo)
+			return;
+		if (target->type == OperationType::Undo)
+		{
+			target->has_undo = true;
+			target = static_cast<StoredUndo *>(target)->target;
+			redo(RedoOperation(op.replica, op.stamp, OperationID{replicas[target->replica]->id, target->stamp()}));
+			return;
+		}
+		if (target->type == OperationType::Redo)
+		{
+			target->has_undo = true;
+			target = static_cast<StoredRedo *>(target)->target;
+		}
+		auto *undo_op = storeOp<StoredUndo>(op.replica, op.stamp, target);
+		undoOp(target);
+	}
+
+	void redo(const RedoOperation &op)
+	{
+		const Replica *replica = findReplica(op.target.replica);
+		if (replica == nullptr)
+			return;
+		StoredOperation *target = replica->ops.get(op.target.stamp);
+		if (target == nullptr || !target->has_undo)
+			return;
+		if (target->type == OperationType::Undo)
+		{
+			target->has_undo = false;
+			target = static_cast<StoredUndo *>(target)->target;
+			undo(UndoOperation(op.replica, op.stamp, OperationID{replicas[target->replica]->id, target->stamp()}));
+			return;
+		}
+		if (target->type == OperationType::Redo)
+		{
+			target->has_undo = false;
+			target = static_cast<StoredRedo *>(target)->target;
+		}
+		auto *redo_op = storeOp<StoredRedo>(op.replica, op.stamp, target);
+		redoOp(target);
+	}
+
+protected:
+	// inserts the tags of [begin, end) for stored_op and removes the text between them
+	void applyDeletion(StoredDeletion *stored_op, const StoredAnchor &begin, const StoredAnchor &end)
+	{
 		auto [left, right] = deletions.apply(
 			RangeTag(true, begin, stored_op), RangeTag(false, end, stored_op), piece_tree);
 
@@ -542,6 +1390,7 @@ public:
 		if (piece_before != piece_tree.begin())
 		{
 			--piece_before;
+			piece_tree.settle(piece_before);
 			auto op = piece_before->tombStone;
 			assert(op == nullptr || op->right->old.isGood());
 			if (op == nullptr)
@@ -562,6 +1411,7 @@ public:
 		auto piece_after = right_piece;
 		if (piece_after != piece_tree.end())
 		{
+			piece_tree.settle(piece_after);
 			auto op = piece_after->tombStone;
 			assert(op == nullptr || op->left->old.isGood());
 			if (op == nullptr)
@@ -582,75 +1432,18 @@ public:
 		stored_op->right = &*right_it;
 
 		// TODO: no need to redo if op is local change.
-		redoRangeOp(stored_op, [](Piece *piece, StoredRangeOp *op)
-		{
-			if (piece->tombStone == nullptr || *piece->tombStone < *op)
-				piece->tombStone = op;
-		});
-		piece_tree.update(left_piece, right_piece);
+		redoRangeOp(stored_op);
 	}
 
-	// TODO: op is received from other replicas, do we need to transform it?
-	// we need to ensure not undo/redo an undo/redo operation before send it to other replicas
-	void undo(const UndoOperation &op)
-	{
-		auto replica_it = replicas.find(op.target.replica);
-		if (replica_it == replicas.end())
-			return;
-		if (replica_it->segments.size() <= op.target.stamp)
-			return;
-		StoredOperation *target = replica_it->segments[op.target.stamp].get();
-		if (target->has_undo)
-			return;
-		if (target->type == OperationType::Undo)
-		{
-			target->has_undo = true;
-			target = static_cast<StoredUndo *>(target)->target;
-			redo(RedoOperation(op.replica, op.stamp, OperationID{target->replica->id, target->stamp}));
-			return;
-		}
-		if (target->type == OperationType::Redo)
-		{
-			target->has_undo = true;
-			target = static_cast<StoredRedo *>(target)->target;
-		}
-		auto *undo_op = storeOp<StoredUndo>(op.replica, op.stamp, target);
-		undoOp(target);
-	}
-
-	void redo(const RedoOperation &op)
-	{
-		auto replica_it = replicas.find(op.target.replica);
-		if (replica_it == replicas.end())
-			return;
-		if (replica_it->segments.size() <= op.target.stamp)
-			return;
-		StoredOperation *target = replica_it->segments[op.target.stamp].get();
-		if (!target->has_undo)
-			return;
-		if (target->type == OperationType::Undo)
-		{
-			target->has_undo = false;
-			target = static_cast<StoredUndo *>(target)->target;
-			undo(UndoOperation(op.replica, op.stamp, OperationID{target->replica->id, target->stamp}));
-			return;
-		}
-		if (target->type == OperationType::Redo)
-		{
-			target->has_undo = false;
-			target = static_cast<StoredRedo *>(target)->target;
-		}
-		auto *redo_op = storeOp<StoredRedo>(op.replica, op.stamp, target);
-		redoOp(target);
-	}
-
-protected:
 	void redoOp(StoredOperation *target)
 	{
 		switch (target->type)
 		{
 		case OperationType::Insert:
-			redoInsertion(static_cast<Segment *>(target));
+			if (target->appended)
+				redoInsertion(static_cast<StoredAppend *>(target)->undo_op, target);
+			else
+				redoInsertion(static_cast<Segment *>(target)->undo_op, target);
 			break;
 		case OperationType::Delete:
 			redoDel(static_cast<StoredDeletion *>(target));
@@ -667,7 +1460,16 @@ protected:
 		switch (target->type)
 		{
 		case OperationType::Insert:
-			undoInsertion(static_cast<Segment *>(target));
+			if (target->appended)
+			{
+				auto *append = static_cast<StoredAppend *>(target);
+				undoInsertion(append->undo_op, target, append->seg, append->pos, append->len);
+			}
+			else
+			{
+				auto *segment = static_cast<Segment *>(target);
+				undoInsertion(segment->undo_op, target, segment, 0, segment->own_length);
+			}
 			break;
 		case OperationType::Delete:
 			undoDel(static_cast<StoredDeletion *>(target));
@@ -681,18 +1483,13 @@ protected:
 
 	void redoDel(StoredDeletion *target)
 	{
-		redoRangeOp(target, [](Piece *piece, StoredRangeOp *op)
-		{
-			if (piece->tombStone == nullptr || *piece->tombStone < *op)
-				piece->tombStone = static_cast<StoredRangeOp *>(op);
-		});
-
-		auto left_piece = piece_tree.find(target->left->anchor);
-		auto right_piece = piece_tree.find(target->right->anchor);
-		piece_tree.update(&*left_piece, &*right_piece);
+		redoRangeOp(target);
 		target->has_undo = false;
 	}
 
+	// unlike cover(), this is linear in the pieces between the tags of target: each piece buried by it
+	// falls back to the newest op still covering it, which differs between the tags, so every piece in
+	// the range is settled and visited
 	void undoDel(StoredDeletion *target)
 	{
 		auto ops_covered = undoRangeOp(target, [target](Piece *piece, StoredRangeOp *newest)
@@ -701,89 +1498,74 @@ protected:
 				piece->tombStone = static_cast<StoredRangeOp *>(newest);
 		});
 
-		for (auto ops : ops_covered)
-		{
-			redoRangeOp(ops, [](Piece *piece, StoredRangeOp *op)
-			{
-				if (piece->tombStone == nullptr || *piece->tombStone < *op)
-					piece->tombStone = static_cast<StoredRangeOp *>(op);
-			});
-		}
-
+		// summaries of the walked pieces first, covering keeps them exact afterwards
 		auto left_piece = piece_tree.find(target->left->anchor);
 		auto right_piece = piece_tree.find(target->right->anchor);
-		piece_tree.update(&*left_piece, &*right_piece);
+		piece_tree.settle(left_piece, right_piece);
+		piece_tree.update(left_piece, right_piece);
+
+		for (auto ops : ops_covered)
+			redoRangeOp(ops);
 		target->has_undo = true;
 	}
 
-	void redoInsertion(Segment *target)
+	void redoInsertion(StoredDeletion *undo_op, StoredOperation *target)
 	{
-		if (target->undo_op != nullptr)
-			redoDel(target->undo_op);
+		if (undo_op != nullptr)
+			undoDel(undo_op);
 		target->has_undo = false;
 	}
 
-	void undoInsertion(Segment *target)
+	// removes [pos, pos + len) of segment, the text inserted by target. the deletion is kept in undo_op,
+	// its right tag is at whatever follows the last character in the history, text inserted in front of
+	// the next character of segment lies outside
+	void undoInsertion(StoredDeletion *&undo_op, StoredOperation *target, Segment *segment, size_t pos, size_t len)
 	{
-		if (target->undo_op == nullptr)
+		if (len == 0) // an empty insertion has no last character and nothing to remove
 		{
-			auto *stored_op = storeOp<StoredDeletion>(target->replica, target->stamp);
-			auto begin = StoredAnchor(target, 0);
-			auto end = StoredAnchor(target, target->len() - 1);
-			auto [left, right] = deletions.apply(
-				RangeTag(true, begin, stored_op), RangeTag(false, end, stored_op), piece_tree);
-			auto [left_it, left_piece] = left;
-			auto [right_it, right_piece] = right;
-			stored_op->left = &*left_it;
-			stored_op->right = &*right_it;
-
-			target->undo_op = static_cast<StoredDeletion *>(stored_op);
-
-			redoRangeOp(target->undo_op, [](Piece *piece, StoredRangeOp *op)
-			{
-				if (piece->tombStone == nullptr || *piece->tombStone < *op)
-					piece->tombStone = static_cast<StoredRangeOp *>(op);
-			});
-			piece_tree.update(left_piece, right_piece);
+			target->has_undo = true;
+			return;
 		}
-		else
+		if (undo_op == nullptr)
 		{
-			auto left_piece = piece_tree.find(target->undo_op->left->anchor);
-			auto right_piece = piece_tree.find(target->undo_op->right->anchor);
-			redoRangeOp(target->undo_op, [](Piece *piece, StoredRangeOp *op)
+			auto *stored_op = deriveOp<StoredDeletion>(target);
+			auto begin = StoredAnchor(segment, pos);
+			auto end = StoredAnchor(segment, pos + len);
+			auto next = piece_tree.find(StoredAnchor(segment, pos + len - 1));
+			if (next->seg_pos + next->len == pos + len)
 			{
-				if (piece->tombStone == nullptr || *piece->tombStone < *op)
-					piece->tombStone = static_cast<StoredRangeOp *>(op);
-			});
-			piece_tree.update(left_piece, right_piece);
+				do
+					++next;
+				while (next->len == 0);
+				end = StoredAnchor(next->seg, next->seg_pos);
+			}
+			applyDeletion(stored_op, begin, end);
+			undo_op = stored_op;
 		}
+		else
+			redoRangeOp(undo_op);
 		target->has_undo = true;
 	}
 
+	// pieces between the tags of stored_op are removed by it where it is newer, in O(log n) by PieceTree::cover.
 	// won't update tag->old if it is not nullptr
-	template <typename UpdateFunc>
-	void redoRangeOp(StoredRangeOp *stored_op, const UpdateFunc &updateFunc)
+	void redoRangeOp(StoredRangeOp *stored_op)
 	{
 		// TODO: handle left->old and right->old update
 		stored_op->has_undo = false;
-		auto left_it = decltype(deletions)::Iterator(stored_op->left);
-		auto right_it = decltype(deletions)::Iterator(stored_op->right);
+		auto left_it = typename TagTree::Iterator(stored_op->left);
+		auto right_it = typename TagTree::Iterator(stored_op->right);
+		auto right_piece = piece_tree.cut(stored_op->right->anchor);
+		auto left_piece = piece_tree.cut(stored_op->left->anchor);
+		piece_tree.cover(left_piece, right_piece, stored_op);
 
 		bool has_across = false;
 		auto first_across = left_it;
 		auto last_across = right_it;
-		auto begin_piece = piece_tree.find(stored_op->left->anchor);
 		// find and update all acrossing tags
 		auto it = left_it;
-		for (++it;; ++it)
+		for (++it; it != right_it; ++it)
 		{
-			for (; begin_piece->seg != it->anchor.seg || begin_piece->seg_pos != it->anchor.pos; ++begin_piece)
-			{
-				updateFunc(&*begin_piece, stored_op);
-			}
-			if (it == right_it)
-				break;
-
 			RangeTag *tag = &*it;
 			if (tag->status == TagStatus::Undone || tag->status == TagStatus::UnUsed)
 				continue;
@@ -863,8 +1645,8 @@ protected:
 	std::vector<StoredRangeOp *> undoRangeOp(StoredRangeOp *stored_op, const UpdateFunc &updateFunc)
 	{
 		stored_op->has_undo = true;
-		auto left_it = decltype(deletions)::Iterator(stored_op->left);
-		auto right_it = decltype(deletions)::Iterator(stored_op->right);
+		auto left_it = typename TagTree::Iterator(stored_op->left);
+		auto right_it = typename TagTree::Iterator(stored_op->right);
 
 		if (left_it->status == TagStatus::UnUsed || right_it->status == TagStatus::UnUsed)
 		{
@@ -872,18 +1654,21 @@ protected:
 			return {};
 		}
 		left_it->status = right_it->status = TagStatus::Undone;
+		deletions.restoreBoundaries(left_it, right_it, piece_tree);
 
 		// find all unused tags to update later
 		// unused range ops must be fully covered by another op, so we only need to check ops fully covered by this op
 		std::unordered_set<StoredRangeOp *> unused_ops;
 		std::vector<StoredRangeOp *> ops_covered;
-		auto begin_piece = piece_tree.find(stored_op->left->anchor);
+		auto begin_piece = deletions.pieceOf(stored_op->left, piece_tree);
+		piece_tree.settle(begin_piece, deletions.pieceOf(stored_op->right, piece_tree));
 		StoredRangeOp *newest = left_it->old;
 		auto it = left_it;
 		for (++it;; ++it)
 		{
-			// update piece tree
-			for (; begin_piece->seg != it->anchor.seg || begin_piece->seg_pos != it->anchor.pos; ++begin_piece)
+			// update piece tree up to the piece cut() returns for the tag, the same range cover() takes.
+			// an empty piece left by split() can carry the same anchor in front of it
+			for (auto end_piece = deletions.pieceOf(&*it, piece_tree); begin_piece != end_piece; ++begin_piece)
 			{
 				updateFunc(&*begin_piece, newest);
 			}
@@ -945,31 +1730,80 @@ protected:
 		return ops_covered;
 	}
 
+	// ReplicaIDs of received ops are translated here, stored ops reference the interned replica
+	Replica *findReplica(const ReplicaID &id) const
+	{
+		return replicas.find(id);
+	}
+
 	Replica *getReplica(const ReplicaID &id)
 	{
-		auto it = replicas.find(id, [](const Replica &a, const ReplicaID &b)
+		return replicas.intern(id);
+	}
+
+	void insertSegment(Segment *segment, const Anchor &anchor)
+	{
+		auto stored = toStored(anchor);
+		if (stored.seg == nullptr)
+			return; // invalid anchor
+		segment->parent = stored.seg;
+		segment->insert_pos = stored.pos;
+		piece_tree.insert(segment);
+		replicas[segment->replica]->typing = segment;
+	}
+
+	// run-length merging of typing: an insertion its author marked as continuing, at the place of the
+	// latest op of its replica, which was an insertion too, extends the segment of that op and is stored
+	// as a StoredAppend. the rule only looks at the op and its causal past, so every replica merges the
+	// same ops, and the appended text keeps the order of the segment against concurrent insertions at the
+	// same place
+	bool append(Replica *replica, const InsertionView &op, const Utf8Scan &scan)
+	{
+		Segment *segment = replica->typing;
+		if (!op.continues || segment == nullptr || scan.length == 0 || segment->len() + scan.length > Max_Typed_Length)
+			return false;
+		if (toStored(op.anchor) != StoredAnchor(segment->parent, segment->insert_pos))
+			return false;
+		size_t pos = segment->len(), size = op.str.size();
+		if (replica->text.appendsAt(segment->data + segment->byte_length, size))
+			replica->text.append(op.str.data(), size);
+		else
 		{
-			return a.id < b;
-		});
-		if (it == replicas.end())
-			return &*replicas.insert(Replica{.id = id});
-		return &*it;
+			// a full arena chunk or an adopted buffer, the segment moves to the arena with the text
+			char *text = replica->text.allocate(segment->byte_length + size);
+			memcpy(text, segment->data, segment->byte_length);
+			memcpy(text + segment->byte_length, op.str.data(), size);
+			piece_tree.relocate(segment, text);
+		}
+		segment->append(std::string_view(segment->data + segment->byte_length, size), scan);
+		storeOp<StoredAppend>(replica, op.stamp, segment, pos, scan.length);
+		piece_tree.append(segment, pos, scan.length);
+		replica->typing = segment;
+		return true;
 	}
-	StoredAnchor toStored(const Anchor &anchor)
+
+	// the wire form of an anchor, the replica is translated back to its ReplicaID
+	Anchor toAnchor(const StoredAnchor &stored) const
 	{
-		auto replica_it = replicas.find(anchor.replica);
-		if (replica_it == replicas.end())
-			return StoredAnchor();
+		return Anchor{replicas[stored.seg->replica]->id, stored.seg->stamp(), stored.pos};
+	}
 
-		auto replica = replica_it;
-		if (anchor.stamp >= replica->segments.size())
+	StoredAnchor toStored(const Anchor &anchor)
+	{
+		const Replica *replica = findReplica(anchor.replica);
+		if (replica == nullptr)
 			return StoredAnchor();
 
-		auto &seg_ptr = replica->segments[anchor.stamp];
-		if (!seg_ptr || seg_ptr->type != OperationType::Insert)
+		StoredOperation *seg_op = replica->ops.get(anchor.stamp);
+		if (!seg_op || seg_op->type != OperationType::Insert)
 			return StoredAnchor();
 
-		return StoredAnchor(static_cast<Segment *>(seg_ptr.get()), anchor.pos);
+		if (seg_op->appended)
+		{
+			auto *append = static_cast<StoredAppend *>(seg_op);
+			return StoredAnchor(append->seg, append->pos + anchor.pos);
+		}
+		return StoredAnchor(static_cast<Segment *>(seg_op), anchor.pos);
 	}
 
 	template <typename T, typename... Args>
@@ -985,13 +1819,26 @@ protected:
 	{
 		lamport_stamp = std::max(lamport_stamp, stamp) + 1;
 
-		replica->segments.resize(lamport_stamp);
-		assert(replica->segments[stamp] == nullptr);
-		replica->segments[stamp] = std::make_unique<T>(std::forward<Args>(args)...);
+		assert(replica->ops.get(stamp) == nullptr);
+		T *op = replica->arena<T>().create(std::forward<Args>(args)...);
+		replica->ops.set(stamp, op);
+		op->replica = replica->index;
+		op->key = orderKey(stamp, replica->rank);
+		replica->typing = nullptr;
+		return op;
+	}
 
-		T *op = static_cast<T *>(replica->segments[stamp].get());
-		op->replica = replica;
-		op->stamp = stamp;
+	// an op created locally for another one, like the deletion undoing an insertion. it shares the
+	// stamp of origin and stays out of the op table
+	template <typename T, typename... Args>
+	T *deriveOp(const StoredOperation *origin, Args &&...args)
+	{
+		T *op = replicas[origin->replica]->arena<T>().create(std::forward<Args>(args)...);
+		op->replica = origin->replica;
+		op->key = origin->key;
 		return op;
 	}
 };
+
+using PieceCRDT = BasicPieceCRDT<>;
+using AttachedPieceCRDT = BasicPieceCRDT<defaultFanout<PieceInfo>(), defaultFanout<RangeTag *>(), true>;
\ No newline at end of file
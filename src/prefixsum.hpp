@@ -0,0 +1,106 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#include "simd.hpp"
+
+// Keys are arrays of `Stride` size_t metrics, `Metric` selects one of them.
+// Returns the first index i with pos < values[0] + ... + values[i], or count if there is none.
+template <size_t Stride, size_t Metric>
+uint8_t prefixSearchScalar(const size_t *keys, uint8_t count, size_t pos)
+{
+	size_t sum = 0;
+	for (uint8_t i = 0; i < count; ++i)
+	{
+		sum += keys[i * Stride + Metric];
+		if (pos < sum)
+			return i;
+	}
+	return count;
+}
+
+#if PIECES_SIMD == 2
+// inclusive prefix sum of 4 lanes
+inline __m256i prefixSum4(__m256i x)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+	x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x0f));
+	return x;
+}
+
+template <size_t Stride, size_t Metric>
+inline __m256i loadMetric4(const size_t *keys)
+{
+	static_assert(Stride == 1 || Stride == 2, "only 1 or 2 metrics per key are vectorized");
+	if constexpr (Stride == 1)
+		return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys));
+	else
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys));	 // m0 n0 m1 n1
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + 4)); // m2 n2 m3 n3
+		__m256i x = Metric == 0 ? _mm256_unpacklo_epi64(a, b) : _mm256_unpackhi_epi64(a, b);
+		return _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 1, 2, 0));
+	}
+}
+
+template <size_t Stride, size_t Metric>
+uint8_t prefixSearch(const size_t *keys, uint8_t count, size_t pos)
+{
+	// prefix sums never exceed the document size, so signed comparison is safe
+	const __m256i target = _mm256_set1_epi64x(static_cast<long long>(pos));
+	__m256i carry = _mm256_setzero_si256();
+	uint8_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m256i sum = _mm256_add_epi64(prefixSum4(loadMetric4<Stride, Metric>(keys + i * Stride)), carry);
+		int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(sum, target)));
+		if (mask)
+			return i + std::countr_zero(static_cast<unsigned>(mask));
+		carry = _mm256_permute4x64_epi64(sum, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	size_t rest = static_cast<size_t>(_mm256_extract_epi64(carry, 0));
+	return i + prefixSearchScalar<Stride, Metric>(keys + i * Stride, count - i, pos - rest);
+}
+#elif PIECES_SIMD == 1
+template <size_t Stride, size_t Metric>
+inline __m128i loadMetric2(const size_t *keys)
+{
+	static_assert(Stride == 1 || Stride == 2, "only 1 or 2 metrics per key are vectorized");
+	if constexpr (Stride == 1)
+		return _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys));
+	else
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys));	   // m0 n0
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + 2)); // m1 n1
+		return Metric == 0 ? _mm_unpacklo_epi64(a, b) : _mm_unpackhi_epi64(a, b);
+	}
+}
+
+template <size_t Stride, size_t Metric>
+uint8_t prefixSearch(const size_t *keys, uint8_t count, size_t pos)
+{
+	const __m128i target = _mm_set1_epi64x(static_cast<long long>(pos));
+	__m128i carry = _mm_setzero_si128();
+	uint8_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		__m128i x = loadMetric2<Stride, Metric>(keys + i * Stride);
+		__m128i sum = _mm_add_epi64(_mm_add_epi64(x, _mm_slli_si128(x, 8)), carry);
+		int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(sum, target)));
+		if (mask)
+			return i + (mask & 1 ? 0 : 1);
+		carry = _mm_unpackhi_epi64(sum, sum);
+	}
+	size_t rest = static_cast<size_t>(_mm_cvtsi128_si64(carry));
+	return i + prefixSearchScalar<Stride, Metric>(keys + i * Stride, count - i, pos - rest);
+}
+#else
+template <size_t Stride, size_t Metric>
+uint8_t prefixSearch(const size_t *keys, uint8_t count, size_t pos)
+{
+	return prefixSearchScalar<Stride, Metric>(keys, count, pos);
+}
+#endif
@@ -0,0 +1,18 @@
+#pragma once
+
+// kernels used by prefix search and UTF-8 scanning, select with -DPIECES_SIMD=0 (scalar), 1 (SSE4.2) or 2 (AVX2)
+#ifndef PIECES_SIMD
+#if defined(__AVX2__)
+#define PIECES_SIMD 2
+#elif defined(__SSE4_2__)
+#define PIECES_SIMD 1
+#else
+#define PIECES_SIMD 0
+#endif
+#endif
+
+#if PIECES_SIMD == 2
+#include <immintrin.h>
+#elif PIECES_SIMD == 1
+#include <nmmintrin.h>
+#endif
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// sparse map from stamp to T *. stamps are grouped into pages of consecutive stamps, which are found
+// through an open addressing table keyed by stamp / Page_Size. a replica typing alone fills its pages,
+// one among many collaborators gets a page per op, either way memory follows the stored ops and not
+// the Lamport clock. a lookup is a hash, usually one probe and a load from the page
+template <typename T, uint8_t Page_Bits = 3>
+class StampTable
+{
+private:
+	static constexpr uint32_t Page_Size = 1u << Page_Bits;
+
+	struct Page
+	{
+		uint32_t key;
+		T *values[Page_Size]{};
+	};
+
+	std::vector<std::unique_ptr<Page>> slots; // size is 0 or a power of 2, at most half full
+	uint8_t slot_bits{0};
+	size_t count{0};
+	size_t page_count{0};
+
+	size_t slotOf(uint32_t key) const
+	{
+		return static_cast<uint32_t>(key * 0x9e3779b1u) >> (32 - slot_bits); // Fibonacci hashing
+	}
+
+	const std::unique_ptr<Page> *findPage(uint32_t key) const
+	{
+		if (slots.empty())
+			return nullptr;
+		for (size_t i = slotOf(key);; i = (i + 1) & (slots.size() - 1))
+		{
+			if (!slots[i])
+				return nullptr;
+			if (slots[i]->key == key)
+				return &slots[i];
+		}
+	}
+
+	void place(std::unique_ptr<Page> page)
+	{
+		size_t i = slotOf(page->key);
+		while (slots[i])
+			i = (i + 1) & (slots.size() - 1);
+		slots[i] = std::move(page);
+	}
+
+	void grow()
+	{
+		auto old = std::move(slots);
+		slot_bits = slot_bits == 0 ? 4 : slot_bits + 1;
+		slots = std::vector<std::unique_ptr<Page>>(size_t(1) << slot_bits);
+		for (auto &page : old)
+			if (page)
+				place(std::move(page));
+	}
+
+public:
+	size_t size() const { return count; }
+	size_t pageCount() const { return page_count; }
+
+	// nullptr if stamp is not set
+	T *get(uint32_t stamp) const
+	{
+		auto *page = findPage(stamp >> Page_Bits);
+		return page ? (*page)->values[stamp & (Page_Size - 1)] : nullptr;
+	}
+
+	// value must not be nullptr, a stamp is set at most once
+	void set(uint32_t stamp, T *value)
+	{
+		uint32_t key = stamp >> Page_Bits;
+		auto *page = findPage(key);
+		if (!page)
+		{
+			if (2 * (page_count + 1) > slots.size())
+				grow();
+			auto created = std::make_unique<Page>();
+			created->key = key;
+			place(std::move(created));
+			++page_count;
+			page = findPage(key);
+		}
+		T *&slot = (*page)->values[stamp & (Page_Size - 1)];
+		count += slot == nullptr;
+		slot = value;
+	}
+
+	// visits the set stamps in increasing order
+	template <typename Func>
+	void forEach(Func &&func) const
+	{
+		std::vector<const Page *> pages;
+		pages.reserve(page_count);
+		for (auto &page : slots)
+			if (page)
+				pages.push_back(page.get());
+		std::sort(pages.begin(), pages.end(), [](const Page *a, const Page *b)
+		{
+			return a->key < b->key;
+		});
+		for (const Page *page : pages)
+			for (T *value : page->values)
+				if (value)
+					func(value);
+	}
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "simd.hpp"
+
+// one pass over inserted text: validity, code points and newlines
+struct Utf8Scan
+{
+	bool valid{true};
+	bool ascii{true};
+	size_t length{0}; // code points, meaningless if not valid
+	size_t newlines{0};
+};
+
+// rejects overlong forms, surrogates, code points above U+10FFFF and truncated sequences
+inline Utf8Scan utf8ScanScalar(const char *data, size_t size)
+{
+	Utf8Scan scan;
+	const auto *bytes = reinterpret_cast<const uint8_t *>(data);
+	for (size_t i = 0; i < size; ++scan.length)
+	{
+		uint8_t c = bytes[i];
+		if (c < 0x80)
+		{
+			scan.newlines += c == '\n';
+			++i;
+			continue;
+		}
+		scan.ascii = false;
+		size_t count;
+		uint32_t code, min;
+		if ((c & 0xe0) == 0xc0)
+			count = 2, code = c & 0x1f, min = 0x80;
+		else if ((c & 0xf0) == 0xe0)
+			count = 3, code = c & 0x0f, min = 0x800;
+		else if ((c & 0xf8) == 0xf0)
+			count = 4, code = c & 0x07, min = 0x10000;
+		else
+			return scan.valid = false, scan;
+		if (size - i < count)
+			return scan.valid = false, scan;
+		for (size_t k = 1; k < count; ++k)
+		{
+			if ((bytes[i + k] & 0xc0) != 0x80)
+				return scan.valid = false, scan;
+			code = code << 6 | (bytes[i + k] & 0x3f);
+		}
+		if (code < min || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff))
+			return scan.valid = false, scan;
+		i += count;
+	}
+	return scan;
+}
+
+#if PIECES_SIMD >= 1
+// error bits of 16 bytes given the 16 before them, from the lookup algorithm of
+// Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+// three table lookups classify every pair of adjacent bytes, a lead byte expecting
+// a third or fourth byte is checked by the shifted inputs
+inline __m128i utf8Errors(__m128i input, __m128i prev_input)
+{
+	constexpr char Too_Short = 1 << 0;	// lead byte not followed by a continuation
+	constexpr char Too_Long = 1 << 1;	// ASCII followed by a continuation
+	constexpr char Overlong_3 = 1 << 2; // 11100000 100_____
+	constexpr char Too_Large = 1 << 3;	// above U+10FFFF
+	constexpr char Surrogate = 1 << 4;	// 11101101 101_____
+	constexpr char Overlong_2 = 1 << 5; // 1100000_ 10______
+	constexpr char Too_Large_1000 = 1 << 6;
+	constexpr char Overlong_4 = 1 << 6; // 11110000 1000____
+	constexpr char Two_Conts = char(1 << 7);
+	constexpr char Carry = Too_Short | Too_Long | Two_Conts;
+
+	const __m128i low_nibble = _mm_set1_epi8(0x0f);
+	__m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+	__m128i byte_1_high = _mm_shuffle_epi8(
+		_mm_setr_epi8(Too_Long, Too_Long, Too_Long, Too_Long, Too_Long, Too_Long, Too_Long, Too_Long, //
+					  Two_Conts, Two_Conts, Two_Conts, Two_Conts, Too_Short | Overlong_2, Too_Short,
+					  Too_Short | Overlong_3 | Surrogate, Too_Short | Too_Large | Too_Large_1000 | Overlong_4),
+		_mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble));
+	__m128i byte_1_low = _mm_shuffle_epi8(
+		_mm_setr_epi8(Carry | Overlong_3 | Overlong_2 | Overlong_4, Carry | Overlong_2, Carry, Carry,
+					  Carry | Too_Large, Carry | Too_Large | Too_Large_1000, Carry | Too_Large | Too_Large_1000,
+					  Carry | Too_Large | Too_Large_1000, Carry | Too_Large | Too_Large_1000,
+					  Carry | Too_Large | Too_Large_1000, Carry | Too_Large | Too_Large_1000,
+					  Carry | Too_Large | Too_Large_1000, Carry | Too_Large | Too_Large_1000,
+					  Carry | Too_Large | Too_Large_1000 | Surrogate, Carry | Too_Large | Too_Large_1000,
+					  Carry | Too_Large | Too_Large_1000),
+		_mm_and_si128(prev1, low_nibble));
+	__m128i byte_2_high = _mm_shuffle_epi8(
+		_mm_setr_epi8(Too_Short, Too_Short, Too_Short, Too_Short, Too_Short, Too_Short, Too_Short, Too_Short,
+					  Too_Long | Overlong_2 | Two_Conts | Overlong_3 | Too_Large_1000 | Overlong_4,
+					  Too_Long | Overlong_2 | Two_Conts | Overlong_3 | Too_Large,
+					  Too_Long | Overlong_2 | Two_Conts | Surrogate | Too_Large,
+					  Too_Long | Overlong_2 | Two_Conts | Surrogate | Too_Large, //
+					  Too_Short, Too_Short, Too_Short, Too_Short),
+		_mm_and_si128(_mm_srli_epi16(input, 4), low_nibble));
+	__m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+	// 111_____ two bytes back or 1111____ three bytes back require a continuation here,
+	// which is exactly where the pair lookup reports Two_Conts
+	__m128i third = _mm_subs_epu8(_mm_alignr_epi8(input, prev_input, 14), _mm_set1_epi8(char(0xe0 - 0x80)));
+	__m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(input, prev_input, 13), _mm_set1_epi8(char(0xf0 - 0x80)));
+	__m128i must_continue = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(char(0x80)));
+	return _mm_xor_si128(must_continue, special);
+}
+
+// non-zero if the last bytes begin a sequence that needs bytes of the next block
+inline __m128i utf8Incomplete(__m128i input)
+{
+	const __m128i max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, char(0xf0 - 1),
+									  char(0xe0 - 1), char(0xc0 - 1));
+	return _mm_subs_epu8(input, max);
+}
+
+// 16 bytes per step, ASCII blocks only count newlines. AVX2 builds use the same 16 byte kernel
+inline Utf8Scan utf8Scan(const char *data, size_t size)
+{
+	Utf8Scan scan;
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i last_continuation = _mm_set1_epi8(char(0xbf)); // signed, lead and ASCII bytes are above
+	__m128i error = _mm_setzero_si128(), prev_input = _mm_setzero_si128(), prev_incomplete = _mm_setzero_si128();
+	auto step = [&](__m128i input)
+	{
+		scan.newlines += std::popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(input, newline))));
+		if (_mm_movemask_epi8(input) == 0)
+		{
+			error = _mm_or_si128(error, prev_incomplete);
+			scan.length += 16;
+		}
+		else
+		{
+			error = _mm_or_si128(error, utf8Errors(input, prev_input));
+			prev_incomplete = utf8Incomplete(input);
+			scan.length += std::popcount(
+				static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpgt_epi8(input, last_continuation))));
+		}
+		prev_input = input;
+	};
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16)
+		step(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)));
+	// the tail is padded with zeros, which are ASCII and end any pending sequence
+	alignas(16) char tail[16] = {};
+	if (size > i) // data may be null for empty input
+		memcpy(tail, data + i, size - i);
+	step(_mm_load_si128(reinterpret_cast<const __m128i *>(tail)));
+	scan.length -= 16 - (size - i);
+	scan.valid = _mm_testz_si128(error, error);
+	scan.ascii = scan.length == size;
+	return scan;
+}
+#else
+inline Utf8Scan utf8Scan(const char *data, size_t size)
+{
+	return utf8ScanScalar(data, size);
+}
+#endif
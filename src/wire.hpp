@@ -0,0 +1,299 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "crdt.hpp"
+
+// binary batches of operations:
+//   version byte, replica table (varint count, 16 bytes per ReplicaID), varint op count, ops
+// an op begins with varint (replica index << 3 | type) and the zigzag delta of its stamp to the op
+// before it. anchors are (replica index, stamp below the op, pos), the end of a deletion in the
+// segment of its begin is only the distance between them. inserted text is varint (length << 1 | continues)
+// and bytes, decoding hands it out as a view into the batch
+constexpr uint8_t Wire_Version = 2;
+
+inline void putVarint(std::string &out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back(static_cast<char>(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<char>(value));
+}
+
+inline uint64_t zigzag(int64_t value)
+{
+	return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value)
+{
+	return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// collects ops into one batch, the replica table holds the replicas the batch mentions
+class WireEncoder
+{
+private:
+	std::string ops;
+	std::vector<ReplicaID> replicas;
+	std::unordered_map<ReplicaID, uint32_t, ReplicaIDHash> indices;
+	size_t count{0};
+	uint32_t prev_stamp{0};
+	uint32_t last{0}; // index of the latest replica, ops and their anchors mostly share it
+
+	uint32_t index(const ReplicaID &id)
+	{
+		if (last < replicas.size() && replicas[last] == id)
+			return last;
+		auto [it, inserted] = indices.try_emplace(id, static_cast<uint32_t>(replicas.size()));
+		if (inserted)
+			replicas.push_back(id);
+		return last = it->second;
+	}
+
+	void putHeader(const Operation &op)
+	{
+		putVarint(ops, uint64_t(index(op.replica)) << 3 | static_cast<uint8_t>(op.type));
+		putVarint(ops, zigzag(int64_t(op.stamp) - prev_stamp));
+		prev_stamp = op.stamp;
+		++count;
+	}
+
+	// anchors point at earlier ops, the stamp is kept as the distance below the op
+	void putAnchor(const Anchor &anchor, uint32_t stamp)
+	{
+		putVarint(ops, index(anchor.replica));
+		putVarint(ops, zigzag(int64_t(stamp) - anchor.stamp));
+		putVarint(ops, anchor.pos);
+	}
+
+	void putTarget(const OperationID &target, uint32_t stamp)
+	{
+		putVarint(ops, index(target.replica));
+		putVarint(ops, zigzag(int64_t(stamp) - target.stamp));
+	}
+
+public:
+	size_t size() const { return count; }
+
+	void add(const InsertionView &op)
+	{
+		putHeader(op);
+		putAnchor(op.anchor, op.stamp);
+		putVarint(ops, uint64_t(op.str.size()) << 1 | op.continues);
+		ops.append(op.str);
+	}
+
+	void add(const Insertion &op)
+	{
+		add(InsertionView(op));
+	}
+
+	void add(const Deletion &op)
+	{
+		putHeader(op);
+		putAnchor(op.begin, op.stamp);
+		if (op.end.replica == op.begin.replica && op.end.stamp == op.begin.stamp)
+		{
+			putVarint(ops, 0); // in the segment of begin
+			putVarint(ops, zigzag(int64_t(op.end.pos) - int64_t(op.begin.pos)));
+		}
+		else
+		{
+			putVarint(ops, uint64_t(index(op.end.replica)) + 1);
+			putVarint(ops, zigzag(int64_t(op.stamp) - op.end.stamp));
+			putVarint(ops, op.end.pos);
+		}
+	}
+
+	void add(const UndoOperation &op)
+	{
+		putHeader(op);
+		putTarget(op.target, op.stamp);
+	}
+
+	void add(const RedoOperation &op)
+	{
+		putHeader(op);
+		putTarget(op.target, op.stamp);
+	}
+
+	// the encoded batch, the encoder is empty again afterwards
+	std::string finish()
+	{
+		std::string batch;
+		batch.reserve(1 + 10 + replicas.size() * 16 + 10 + ops.size());
+		batch.push_back(static_cast<char>(Wire_Version));
+		putVarint(batch, replicas.size());
+		for (const auto &id : replicas)
+			batch.append(reinterpret_cast<const char *>(id.as_bytes().data()), 16);
+		putVarint(batch, count);
+		batch.append(ops);
+		ops.clear();
+		replicas.clear();
+		indices.clear();
+		count = 0;
+		prev_stamp = 0;
+		last = 0;
+		return batch;
+	}
+};
+
+// reads a batch produced by WireEncoder. the views of decoded insertions point into the batch bytes,
+// which have to outlive them
+class WireDecoder
+{
+private:
+	const char *cur;
+	const char *end;
+	std::vector<ReplicaID> replicas;
+	size_t remaining{0};
+	uint32_t prev_stamp{0};
+	bool valid{true};
+
+	uint64_t getVarint()
+	{
+		uint64_t value = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			if (cur == end)
+				break;
+			uint8_t byte = static_cast<uint8_t>(*cur++);
+			value |= uint64_t(byte & 0x7f) << shift;
+			if (byte < 0x80)
+				return value;
+		}
+		valid = false;
+		return 0;
+	}
+
+	const ReplicaID &getReplica()
+	{
+		uint64_t index = getVarint();
+		if (index >= replicas.size())
+		{
+			valid = false;
+			return replicas[0]; // the table is never empty while ops remain
+		}
+		return replicas[index];
+	}
+
+	uint32_t getStamp(uint32_t stamp)
+	{
+		return static_cast<uint32_t>(int64_t(stamp) - unzigzag(getVarint()));
+	}
+
+	Anchor getAnchor(uint32_t stamp)
+	{
+		Anchor anchor;
+		anchor.replica = getReplica();
+		anchor.stamp = getStamp(stamp);
+		anchor.pos = getVarint();
+		return anchor;
+	}
+
+public:
+	explicit WireDecoder(std::string_view batch)
+		: cur(batch.data()), end(batch.data() + batch.size())
+	{
+		if (cur == end || static_cast<uint8_t>(*cur++) != Wire_Version)
+		{
+			valid = false;
+			return;
+		}
+		uint64_t count = getVarint();
+		if (!valid || count > static_cast<size_t>(end - cur) / 16)
+		{
+			valid = false;
+			return;
+		}
+		replicas.reserve(count);
+		for (uint64_t i = 0; i < count; ++i, cur += 16)
+			replicas.emplace_back(reinterpret_cast<const uint8_t *>(cur), reinterpret_cast<const uint8_t *>(cur) + 16);
+		remaining = getVarint();
+		if (replicas.empty() && remaining > 0)
+			valid = false;
+	}
+
+	// false once the batch turned out malformed, ops handed out before stay valid
+	bool ok() const { return valid; }
+
+	// calls visit with an InsertionView, Deletion, UndoOperation or RedoOperation for each op,
+	// returns whether the whole batch was well formed
+	template <typename Visitor>
+	bool decode(Visitor &&visit)
+	{
+		while (valid && remaining > 0)
+		{
+			--remaining;
+			uint64_t head = getVarint();
+			if (head >> 3 >= replicas.size())
+				return valid = false;
+			const ReplicaID &replica = replicas[head >> 3];
+			uint32_t stamp = static_cast<uint32_t>(int64_t(prev_stamp) + unzigzag(getVarint()));
+			prev_stamp = stamp;
+			switch (static_cast<OperationType>(head & 7))
+			{
+			case OperationType::Insert:
+			{
+				Anchor anchor = getAnchor(stamp);
+				uint64_t length = getVarint(), size = length >> 1;
+				if (!valid || size > static_cast<size_t>(end - cur))
+					return valid = false;
+				std::string_view str(cur, size);
+				cur += size;
+				visit(InsertionView(replica, stamp, anchor, str, length & 1));
+				break;
+			}
+			case OperationType::Delete:
+			{
+				Anchor begin = getAnchor(stamp);
+				Anchor end_anchor;
+				uint64_t end_replica = getVarint();
+				if (end_replica == 0)
+				{
+					end_anchor = begin;
+					end_anchor.pos = static_cast<size_t>(int64_t(begin.pos) + unzigzag(getVarint()));
+				}
+				else if (end_replica - 1 < replicas.size())
+				{
+					end_anchor.replica = replicas[end_replica - 1];
+					end_anchor.stamp = getStamp(stamp);
+					end_anchor.pos = getVarint();
+				}
+				else
+					return valid = false;
+				if (!valid)
+					return false;
+				visit(Deletion(replica, stamp, begin, end_anchor));
+				break;
+			}
+			case OperationType::Undo:
+			case OperationType::Redo:
+			{
+				OperationID target;
+				target.replica = getReplica();
+				target.stamp = getStamp(stamp);
+				if (!valid)
+					return false;
+				if (static_cast<OperationType>(head & 7) == OperationType::Undo)
+					visit(UndoOperation(replica, stamp, target));
+				else
+					visit(RedoOperation(replica, stamp, target));
+				break;
+			}
+			default: // formatting has no stored form yet
+				return valid = false;
+			}
+		}
+		return valid && cur == end;
+	}
+};
@@ -0,0 +1,633 @@
+﻿#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bench.hpp"
+#include "piecetree.hpp"
+#include "wire.hpp"
+
+// count every global allocation, so allocator policies can be compared
+static size_t allocation_count = 0;
+static size_t allocated_bytes = 0;
+
+// the whole replaceable set goes through malloc and free, so every new is paired with a matching delete
+static void *countedAlloc(std::size_t size, std::size_t alignment = 0) noexcept
+{
+	++allocation_count;
+	allocated_bytes += size;
+	if (alignment == 0)
+		return std::malloc(size ? size : 1);
+	size_t rounded = size ? (size + alignment - 1) / alignment * alignment : alignment;
+	return std::aligned_alloc(alignment, rounded);
+}
+
+static void *countedAllocOrThrow(std::size_t size, std::size_t alignment = 0)
+{
+	if (void *ptr = countedAlloc(size, alignment))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size) { return countedAllocOrThrow(size); }
+void *operator new[](std::size_t size) { return countedAllocOrThrow(size); }
+void *operator new(std::size_t size, std::align_val_t align) { return countedAllocOrThrow(size, static_cast<size_t>(align)); }
+void *operator new[](std::size_t size, std::align_val_t align) { return countedAllocOrThrow(size, static_cast<size_t>(align)); }
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept { return countedAlloc(size); }
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept { return countedAlloc(size); }
+void *operator new(std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept { return countedAlloc(size, static_cast<size_t>(align)); }
+void *operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept { return countedAlloc(size, static_cast<size_t>(align)); }
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept { std::free(ptr); }
+
+struct Run
+{
+	size_t len{1};
+
+	size_t size() const { return len; }
+};
+
+template <typename Allocator>
+void allocationBench(const char *name, int numInsertions)
+{
+	std::mt19937 gen(42);
+	size_t before = allocation_count;
+	auto start = std::chrono::high_resolution_clock::now();
+	{
+		Sequence<size_t, Run, 4, Allocator> seq;
+		for (int i = 0; i < numInsertions; ++i)
+		{
+			std::uniform_int_distribution<size_t> pos_dist(0, seq.size());
+			seq.insertBefore(seq.find(pos_dist(gen)), Run{1});
+		}
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << name << ": " << (allocation_count - before) / (double)numInsertions << " allocations per insert, "
+			  << duration.count() << "ms\n";
+}
+
+// keystrokes at one cursor always hit the slot after the previous insert
+template <typename Allocator>
+void typingBench(const char *name, int numInsertions)
+{
+	Sequence<size_t, Run, 4, Allocator> seq;
+	for (int i = 0; i < 1000; ++i)
+		seq.insertBefore(seq.end(), Run{1});
+	auto cursor = seq.find(seq.size() / 2);
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < numInsertions; ++i)
+		cursor = seq.insertAfter(cursor, Run{1});
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::cout << name << " typing: " << duration.count() << "ms\n";
+}
+
+// loading a snapshot: one insert per value against one bottom-up build
+void bulkLoadBench(int numValues)
+{
+	std::vector<Run> values(numValues, Run{3});
+	auto start = std::chrono::high_resolution_clock::now();
+	{
+		Sequence<size_t, Run, 4> seq;
+		for (const auto &value : values)
+			seq.insertBefore(seq.end(), value);
+	}
+	auto mid = std::chrono::high_resolution_clock::now();
+	{
+		Sequence<size_t, Run, 4> seq(values.begin(), values.end());
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "Load " << numValues << " values: insertBefore "
+			  << std::chrono::duration_cast<std::chrono::milliseconds>(mid - start).count() << "ms, build "
+			  << std::chrono::duration_cast<std::chrono::milliseconds>(end - mid).count() << "ms\n";
+}
+
+class FingerDocument : public PieceCRDT
+{
+public:
+	const auto &tree() const { return piece_tree; }
+	size_t historyOffset(const Anchor &anchor) { return piece_tree.historyOffset(toStored(anchor)); }
+};
+
+// type at a cursor that jumps to a random place every 50 keystrokes
+void fingerBench(int numInsertions)
+{
+	std::mt19937 gen(42);
+	FingerDocument doc;
+	size_t tot_len = 0, cursor = 0;
+	uint32_t operation_stamp = 1;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < numInsertions; ++i)
+	{
+		if (i % 50 == 0)
+			cursor = std::uniform_int_distribution<size_t>(0, tot_len)(gen);
+		Anchor anchor = doc.anchor(cursor);
+		Insertion insertion(doc.id(), operation_stamp++, anchor, "x", doc.continuesTyping(doc.id(), anchor));
+		doc.insert(insertion);
+		++tot_len;
+		++cursor;
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	size_t hits = doc.tree().fingerHits(), misses = doc.tree().fingerMisses();
+	std::cout << "Finger typing: " << duration.count() << "ms, finger hit rate "
+			  << 100.0 * hits / (hits + misses) << "% (" << hits << " hits, " << misses << " misses)\n";
+}
+
+// export a document where most of the typed text has been deleted again
+void exportBench(int numInsertions)
+{
+	std::mt19937 gen(42);
+	PieceCRDT doc;
+	size_t tot_len = 0;
+	uint32_t operation_stamp = 1;
+	for (int i = 0; i < numInsertions; ++i)
+	{
+		size_t pos = std::uniform_int_distribution<size_t>(0, tot_len)(gen);
+		Insertion insertion(doc.id(), operation_stamp++, doc.anchor(pos), "xy");
+		doc.insert(insertion);
+		tot_len += 2;
+		if (i % 10 != 9)
+			continue;
+		// delete all but a few characters of the document
+		size_t keep = std::min<size_t>(tot_len, 10);
+		size_t begin = std::uniform_int_distribution<size_t>(0, keep)(gen);
+		Deletion deletion(doc.id(), operation_stamp++, doc.anchor(begin), doc.anchor(begin + tot_len - keep));
+		doc.del(deletion);
+		tot_len = keep;
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	std::string all;
+	for (auto it = doc.begin(), end_it = --doc.end(); it != end_it; ++it)
+		if (!it->isRemoved())
+			all.append(it->data, it->len);
+	auto mid = std::chrono::high_resolution_clock::now();
+	std::string visible = doc.toString();
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "Export " << visible.size() << " visible of " << (--doc.end()).position().total
+			  << " characters: every piece " << std::chrono::duration<double, std::micro>(mid - start).count()
+			  << "us, visible only " << std::chrono::duration<double, std::micro>(end - mid).count() << "us"
+			  << (all == visible ? "" : " (content differs)") << "\n";
+}
+
+// pasted files typed into all over, then anchors inside the pasted segments are resolved
+void pasteEditBench(int numInsertions, int numPastes, size_t pasteLen)
+{
+	std::mt19937 gen(42);
+	FingerDocument doc;
+	uint32_t operation_stamp = 1;
+	for (int i = 0; i < numPastes; ++i)
+	{
+		Insertion paste(doc.id(), operation_stamp++, doc.anchor(i * pasteLen), std::string(pasteLen, 'x'));
+		doc.insert(paste);
+	}
+	std::vector<Anchor> anchors;
+	for (int i = 0; i < numInsertions; ++i)
+		anchors.push_back(doc.anchor(std::uniform_int_distribution<size_t>(0, numPastes * pasteLen - 1)(gen)));
+	auto start = std::chrono::high_resolution_clock::now();
+	for (const auto &anchor : anchors)
+	{
+		Insertion insertion(doc.id(), operation_stamp++, anchor, "y");
+		doc.insert(insertion);
+	}
+	auto mid = std::chrono::high_resolution_clock::now();
+	size_t sink = 0;
+	for (const auto &anchor : anchors)
+		sink += doc.historyOffset(anchor);
+	auto end = std::chrono::high_resolution_clock::now();
+	doNotOptimize(sink);
+	std::cout << numPastes << " pastes of " << pasteLen << " characters, " << numInsertions << " insertions into them "
+			  << std::chrono::duration_cast<std::chrono::milliseconds>(mid - start).count() << "ms, resolving their anchors "
+			  << std::chrono::duration_cast<std::chrono::milliseconds>(end - mid).count() << "ms\n";
+}
+
+// single keystrokes all over one large paste, every one splits a piece of the pasted segment and goes
+// into its piece index
+void largePasteBench(int numEdits, size_t pasteLen)
+{
+	std::mt19937 gen(42);
+	FingerDocument doc;
+	uint32_t operation_stamp = 1;
+	Insertion paste(doc.id(), operation_stamp++, doc.anchor(0), std::string(pasteLen, 'x'));
+	doc.insert(paste);
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < numEdits; ++i)
+	{
+		size_t pos = std::uniform_int_distribution<size_t>(0, doc.size() - 1)(gen);
+		Insertion insertion(doc.id(), operation_stamp++, doc.anchor(pos), "y");
+		doc.insert(insertion);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	double ms = std::chrono::duration<double, std::milli>(end - start).count();
+	std::cout << "Paste of " << pasteLen << " characters, " << numEdits << " edits into it: " << ms << "ms, "
+			  << 1000 * ms / numEdits << "us per edit, " << doc.tree().size() << " pieces\n";
+}
+
+// splits inside one large non-ASCII paste, each split finds its byte offset from a checkpoint
+void utf8SplitBench(int numInsertions, size_t pasteLen)
+{
+	std::mt19937 gen(42);
+	PieceCRDT doc;
+	uint32_t operation_stamp = 1;
+	std::string text;
+	for (size_t i = 0; i < pasteLen; ++i)
+		text += i % 2 ? "\u00e9" : "a";
+	Insertion paste(doc.id(), operation_stamp++, doc.anchor(0), text);
+	doc.insert(paste);
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < numInsertions; ++i)
+	{
+		size_t pos = std::uniform_int_distribution<size_t>(0, doc.size() - 1)(gen);
+		Insertion insertion(doc.id(), operation_stamp++, doc.anchor(pos), "\u4e2d");
+		doc.insert(insertion);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "UTF-8 paste of " << pasteLen << " characters, " << numInsertions << " insertions into it: "
+			  << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+}
+
+// keystrokes at a cursor that jumps every 50 of them, consecutive ones are merged into one segment
+void typingMemoryBench(int numInsertions)
+{
+	std::mt19937 gen(42);
+	size_t before = allocation_count, before_bytes = allocated_bytes;
+	auto start = std::chrono::high_resolution_clock::now();
+	PieceCRDT doc;
+	size_t tot_len = 0, cursor = 0;
+	uint32_t operation_stamp = 1;
+	for (int i = 0; i < numInsertions; ++i)
+	{
+		if (i % 50 == 0)
+			cursor = std::uniform_int_distribution<size_t>(0, tot_len)(gen);
+		Anchor anchor = doc.anchor(cursor);
+		Insertion insertion(doc.id(), operation_stamp++, anchor, "x", doc.continuesTyping(doc.id(), anchor));
+		doc.insert(insertion);
+		++tot_len;
+		++cursor;
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "Typing at a cursor: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+			  << "ms, " << (allocation_count - before) / (double)numInsertions << " allocations and "
+			  << (allocated_bytes - before_bytes) / (double)numInsertions << " bytes per keystroke, "
+			  << doc.pieceCount() << " pieces\n";
+}
+
+// every replica of a large session types a little, each stored op is indexed by the table of its replica
+void collaboratorsBench(int numReplicas, int numInsertions)
+{
+	std::mt19937 gen(42);
+	std::vector<ReplicaID> ids(numReplicas);
+	for (auto &id : ids)
+		id = uuids::uuid_system_generator{}();
+	size_t before_bytes = allocated_bytes;
+	auto start = std::chrono::high_resolution_clock::now();
+	PieceCRDT doc;
+	uint32_t operation_stamp = 1;
+	for (int i = 0; i < numInsertions; ++i)
+	{
+		Insertion insertion(ids[gen() % ids.size()], operation_stamp++, doc.anchor(gen() % (doc.size() + 1)), "x");
+		doc.insert(insertion);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << numReplicas << " collaborators: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+			  << "ms, " << (allocated_bytes - before_bytes) / (double)numInsertions << " bytes per op\n";
+}
+
+// a session of 20 replicas typing, deleting and undoing, shipped in batches of 1000 ops
+void wireBench(int numOps)
+{
+	std::mt19937 gen(42);
+	std::vector<ReplicaID> ids(20);
+	for (auto &id : ids)
+		id = uuids::uuid_system_generator{}();
+	std::vector<Insertion> insertions;
+	std::vector<Deletion> deletions;
+	std::vector<UndoOperation> undos;
+	std::vector<std::pair<OperationType, size_t>> order;
+	uint32_t stamp = 1;
+	for (int i = 0; i < numOps; ++i, ++stamp)
+	{
+		const ReplicaID &replica = ids[i / 50 % ids.size()]; // runs of one replica
+		Anchor anchor{replica, stamp - 1, 0};
+		size_t kind = gen() % 20;
+		if (kind < 17)
+		{
+			order.emplace_back(OperationType::Insert, insertions.size());
+			insertions.emplace_back(replica, stamp, anchor, kind == 0 ? std::string(40, 'p') : "k");
+		}
+		else if (kind < 19)
+		{
+			order.emplace_back(OperationType::Delete, deletions.size());
+			Anchor end = anchor;
+			end.pos = 1 + gen() % 8;
+			deletions.emplace_back(replica, stamp, anchor, end);
+		}
+		else
+		{
+			order.emplace_back(OperationType::Undo, undos.size());
+			undos.emplace_back(replica, stamp, OperationID{replica, stamp - 1});
+		}
+	}
+
+	std::vector<std::string> batches;
+	size_t bytes = 0, text_bytes = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+	WireEncoder encoder;
+	for (auto [type, k] : order)
+	{
+		if (type == OperationType::Insert)
+			encoder.add(insertions[k]);
+		else if (type == OperationType::Delete)
+			encoder.add(deletions[k]);
+		else
+			encoder.add(undos[k]);
+		if (encoder.size() == 1000)
+			bytes += batches.emplace_back(encoder.finish()).size();
+	}
+	bytes += batches.emplace_back(encoder.finish()).size();
+	auto encoded = std::chrono::high_resolution_clock::now();
+	size_t decoded_ops = 0;
+	for (const auto &batch : batches)
+	{
+		WireDecoder decoder(batch);
+		decoder.decode([&](const auto &op)
+		{
+			decoded_ops += op.stamp != 0;
+		});
+	}
+	auto decoded = std::chrono::high_resolution_clock::now();
+	for (const auto &insertion : insertions)
+		text_bytes += insertion.str.size();
+
+	auto seconds = [](auto a, auto b)
+	{
+		return std::chrono::duration<double>(b - a).count();
+	};
+	std::cout << "Wire format: " << numOps << " ops in " << bytes / (double)numOps << " bytes per op ("
+			  << text_bytes / (double)numOps << " of them text), encode " << numOps / seconds(start, encoded) / 1e6
+			  << " Mops/s " << bytes / seconds(start, encoded) / 1e6 << " MB/s, decode "
+			  << decoded_ops / seconds(encoded, decoded) / 1e6 << " Mops/s " << bytes / seconds(encoded, decoded) / 1e6
+			  << " MB/s\n";
+}
+
+// one huge non-ASCII file pasted as bounded chunks or as a single piece, then edited and deleted from all over
+void hugePasteBench(const char *name, size_t maxPieceLen, int numEdits, size_t pasteLen)
+{
+	std::mt19937 gen(42);
+	PieceCRDT doc;
+	doc.setMaxPieceLength(maxPieceLen);
+	uint32_t operation_stamp = 1;
+	std::string text;
+	for (size_t i = 0; i < pasteLen; ++i)
+		text += i % 2 ? "\u00e9" : "a";
+	auto start = std::chrono::high_resolution_clock::now();
+	Insertion paste(doc.id(), operation_stamp++, doc.anchor(0), text);
+	doc.insert(paste);
+	auto mid = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < numEdits; ++i)
+	{
+		size_t pos = std::uniform_int_distribution<size_t>(0, doc.size() - 10)(gen);
+		if (i % 2)
+		{
+			Deletion deletion(doc.id(), operation_stamp++, doc.anchor(pos), doc.anchor(pos + 5));
+			doc.del(deletion);
+			continue;
+		}
+		Insertion insertion(doc.id(), operation_stamp++, doc.anchor(pos), "\u4e2d");
+		doc.insert(insertion);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << name << ": paste of " << pasteLen << " characters "
+			  << std::chrono::duration_cast<std::chrono::milliseconds>(mid - start).count() << "ms, " << numEdits
+			  << " edits into it " << std::chrono::duration_cast<std::chrono::milliseconds>(end - mid).count()
+			  << "ms, " << doc.pieceCount() << " pieces\n";
+}
+
+// a batch of insertions received into one buffer, applied as decoded strings, as views copied into
+// the arena, and as views into the adopted buffer
+void batchIngestBench(int numOps, size_t maxLen)
+{
+	std::mt19937 gen(42);
+	std::string received;
+	std::vector<std::pair<size_t, size_t>> texts;
+	std::vector<size_t> positions;
+	for (size_t i = 0; i < static_cast<size_t>(numOps); ++i)
+	{
+		size_t len = std::uniform_int_distribution<size_t>(1, maxLen)(gen);
+		positions.push_back(std::uniform_int_distribution<size_t>(0, received.size())(gen));
+		texts.emplace_back(received.size(), len);
+		received.append(len, 'a' + i % 26);
+	}
+	std::shared_ptr<const char[]> buffer(new char[received.size()]);
+	memcpy(const_cast<char *>(buffer.get()), received.data(), received.size());
+
+	auto apply = [&](const char *name, auto &&insert)
+	{
+		PieceCRDT doc;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (size_t i = 0; i < texts.size(); ++i)
+			insert(doc, static_cast<uint32_t>(i + 1), doc.anchor(positions[i]),
+				   std::string_view(buffer.get() + texts[i].first, texts[i].second));
+		auto end = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration<double, std::milli>(end - start).count();
+		std::cout << name << ": " << numOps << " insertions of up to " << maxLen << " bytes " << ms << "ms, "
+				  << numOps / ms * 1000 << " ops/s, " << received.size() / ms / 1000 << " MB/s\n";
+	};
+	apply("Batch ingest, owned strings  ", [](PieceCRDT &doc, uint32_t stamp, const Anchor &anchor, std::string_view text)
+	{
+		doc.insert(Insertion(doc.id(), stamp, anchor, std::string(text)));
+	});
+	apply("Batch ingest, arena copies   ", [](PieceCRDT &doc, uint32_t stamp, const Anchor &anchor, std::string_view text)
+	{
+		doc.insert(InsertionView(doc.id(), stamp, anchor, text));
+	});
+	apply("Batch ingest, adopted buffer ", [&](PieceCRDT &doc, uint32_t stamp, const Anchor &anchor, std::string_view text)
+	{
+		doc.insert(InsertionView(doc.id(), stamp, anchor, text), buffer);
+	});
+}
+
+// overlapping deletions over a long typed document, every deletion inserts two range tags
+// which are ordered against tags anchored in other segments, then all of them are undone and redone
+template <typename Document>
+void deletionBench(const char *name, int numDeletions, size_t docLen)
+{
+	std::mt19937 gen(42);
+	Document doc;
+	uint32_t operation_stamp = 1;
+	for (size_t len = 0; len < docLen; len += 10)
+	{
+		size_t pos = std::uniform_int_distribution<size_t>(0, len)(gen);
+		Insertion insertion(doc.id(), operation_stamp++, doc.anchor(pos), "0123456789");
+		doc.insert(insertion);
+	}
+	std::vector<uint32_t> stamps;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < numDeletions; ++i)
+	{
+		size_t len = std::uniform_int_distribution<size_t>(10, 1000)(gen);
+		size_t pos = std::uniform_int_distribution<size_t>(0, docLen - len)(gen);
+		Deletion deletion(doc.id(), operation_stamp, doc.historyAnchor(pos), doc.historyAnchor(pos + len));
+		stamps.push_back(operation_stamp++);
+		doc.del(deletion);
+	}
+	auto mid = std::chrono::high_resolution_clock::now();
+	for (uint32_t stamp : stamps)
+		doc.undo(UndoOperation(doc.id(), operation_stamp++, OperationID{doc.id(), stamp}));
+	for (uint32_t stamp : stamps)
+		doc.redo(RedoOperation(doc.id(), operation_stamp++, OperationID{doc.id(), stamp}));
+	auto end = std::chrono::high_resolution_clock::now();
+	double del_ms = std::chrono::duration<double, std::milli>(mid - start).count();
+	double undo_ms = std::chrono::duration<double, std::milli>(end - mid).count();
+	std::cout << name << ": " << numDeletions << " deletions on " << docLen << " characters "
+			  << numDeletions / del_ms * 1000 << " deletions/s (" << del_ms << "ms), undo and redo " << undo_ms
+			  << "ms\n";
+}
+
+template <uint8_t Fanout, typename Kernel>
+double prefixSearchTime(const std::vector<size_t> &keys, const std::vector<size_t> &queries, const Kernel &kernel)
+{
+	size_t sink = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int round = 0; round < 100; ++round)
+		for (size_t pos : queries)
+			sink += kernel(keys.data(), Fanout, pos);
+	auto end = std::chrono::high_resolution_clock::now();
+	doNotOptimize(sink);
+	return std::chrono::duration<double, std::nano>(end - start).count() / (100.0 * queries.size());
+}
+
+// one node of PieceInfo keys, searching the visible metric
+template <uint8_t Fanout>
+void prefixSearchBench()
+{
+	std::mt19937 gen(42);
+	std::uniform_int_distribution<size_t> len_dist(0, 20);
+	std::vector<size_t> keys(2 * Fanout);
+	size_t total = 0;
+	for (uint8_t i = 0; i < Fanout; ++i)
+	{
+		keys[2 * i] = len_dist(gen);
+		keys[2 * i + 1] = keys[2 * i] / 2;
+		total += keys[2 * i + 1];
+	}
+	std::uniform_int_distribution<size_t> pos_dist(0, total);
+	std::vector<size_t> queries(10000);
+	for (auto &pos : queries)
+		pos = pos_dist(gen);
+
+	std::vector<size_t> visible(Fanout); // structure-of-arrays layout
+	for (uint8_t i = 0; i < Fanout; ++i)
+		visible[i] = keys[2 * i + 1];
+
+	double scalar = prefixSearchTime<Fanout>(keys, queries, prefixSearchScalar<2, 1>);
+	double simd = prefixSearchTime<Fanout>(keys, queries, prefixSearch<2, 1>);
+	double soa = prefixSearchTime<Fanout>(visible, queries, prefixSearch<1, 0>);
+	std::cout << "fanout " << (int)Fanout << ": scalar " << scalar << "ns, kernel " << simd
+			  << "ns, kernel on SoA " << soa << "ns\n";
+}
+
+// ingest of one large paste: the old scalar count, the scalar scan and the kernel, in GB/s
+void utf8ScanBench(const char *name, const std::string &text)
+{
+	auto measure = [&text](const auto &count)
+	{
+		size_t sink = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int round = 0; round < 10; ++round)
+			sink += count();
+		auto end = std::chrono::high_resolution_clock::now();
+		doNotOptimize(sink);
+		return 10.0 * text.size() / std::chrono::duration<double, std::nano>(end - start).count();
+	};
+	double distance = measure([&] { return utf8::distance(text.data(), text.data() + text.size()); });
+	double scalar = measure([&] { return utf8ScanScalar(text.data(), text.size()).length; });
+	double kernel = measure([&] { return utf8Scan(text.data(), text.size()).length; });
+	std::cout << name << " " << text.size() / 1000000 << "MB: utf8::distance " << distance << "GB/s, scalar scan "
+			  << scalar << "GB/s, kernel " << kernel << "GB/s\n";
+}
+
+void documentAllocationBench(int numInsertions)
+{
+	std::mt19937 gen(42);
+	PieceCRDT doc;
+	size_t tot_len = 0;
+	uint32_t operation_stamp = 1;
+	size_t before = allocation_count;
+	for (int i = 0; i < numInsertions; ++i)
+	{
+		std::uniform_int_distribution<size_t> pos_dist(0, tot_len);
+		Insertion insertion(doc.id(), operation_stamp++, doc.anchor(pos_dist(gen)), "x");
+		doc.insert(insertion);
+		tot_len += 1;
+	}
+	std::cout << "PieceCRDT keystrokes: " << (allocation_count - before) / (double)numInsertions
+			  << " allocations per insert\n";
+}
+
+int main(int argn, char **argv)
+{
+	int numInsertions = 1000000;
+	if (argn > 1)
+		numInsertions = std::atoi(argv[1]);
+
+	std::cout << "Running allocation benchmark with " << numInsertions << " insertions...\n";
+	allocationBench<HeapAllocator>("HeapAllocator ", numInsertions);
+	allocationBench<ArenaAllocator>("ArenaAllocator", numInsertions);
+	typingBench<ArenaAllocator>("ArenaAllocator", numInsertions);
+	documentAllocationBench(numInsertions / 10);
+	fingerBench(numInsertions / 10);
+	typingMemoryBench(numInsertions / 10);
+	collaboratorsBench(1, numInsertions / 10);
+	collaboratorsBench(100, numInsertions / 10);
+	collaboratorsBench(1000, numInsertions / 10);
+	wireBench(numInsertions);
+	bulkLoadBench(numInsertions);
+	exportBench(numInsertions / 10);
+	pasteEditBench(numInsertions / 5, 200, 5000);
+	largePasteBench(numInsertions / 5, 1000000);
+	utf8SplitBench(numInsertions / 100, 1000000);
+	hugePasteBench("Chunked  ", 16384, numInsertions / 10, 50000000);
+	hugePasteBench("Unbounded", SIZE_MAX, numInsertions / 10, 50000000);
+	batchIngestBench(numInsertions / 10, 16);
+	batchIngestBench(numInsertions / 10, 1024);
+	deletionBench<PieceCRDT>("RangeTree   ", numInsertions / 100, 1000000);
+	deletionBench<AttachedPieceCRDT>("BoundaryTags", numInsertions / 100, 1000000);
+
+	std::cout << "Running prefix search benchmark, kernel PIECES_SIMD=" << PIECES_SIMD << "...\n";
+	prefixSearchBench<4>();
+	prefixSearchBench<8>();
+	prefixSearchBench<16>();
+	prefixSearchBench<32>();
+	prefixSearchBench<64>();
+
+	std::cout << "Running UTF-8 scan benchmark, kernel PIECES_SIMD=" << PIECES_SIMD << "...\n";
+	std::string ascii, mixed;
+	for (int i = 0; ascii.size() < 16000000; ++i)
+	{
+		ascii += i % 10 ? "lorem ipsum dolor sit amet " : "lorem ipsum\n";
+		mixed += i % 10 ? "l\u00f6rem \u4e2d\u6587 dolor \U0001f600 " : "l\u00f6rem\n";
+	}
+	utf8ScanBench("ASCII", ascii);
+	utf8ScanBench("Mixed", mixed);
+
+	return 0;
+}
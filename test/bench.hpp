@@ -0,0 +1,13 @@
+﻿#pragma once
+
+// keeps a benchmark result alive, so the work computing it is not optimized away
+template <typename T>
+void doNotOptimize(const T &value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : : "r,m"(value) : "memory");
+#else
+	static volatile T sink;
+	sink = value;
+#endif
+}
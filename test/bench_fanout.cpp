@@ -0,0 +1,88 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "bench.hpp"
+#include "piecetree.hpp"
+
+std::string generateRandomString(std::mt19937 &gen, int minLen, int maxLen)
+{
+	static const char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	std::uniform_int_distribution<> len_dist(minLen, maxLen);
+	std::uniform_int_distribution<> char_dist(0, sizeof(charset) - 2);
+
+	int length = len_dist(gen);
+	std::string result;
+	result.reserve(length);
+	for (int i = 0; i < length; ++i)
+		result += charset[char_dist(gen)];
+	return result;
+}
+
+double elapsedMs(std::chrono::high_resolution_clock::time_point start)
+{
+	auto end = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// insert random strings at random positions, then query random positions and export the whole text
+template <uint8_t PieceN>
+void fanoutBench(int numInsertions)
+{
+	std::mt19937 gen(42);
+	BasicPieceCRDT<PieceN> doc;
+	size_t tot_len = 0;
+	uint32_t operation_stamp = 1;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < numInsertions; ++i)
+	{
+		std::string str = generateRandomString(gen, 1, 20);
+		std::uniform_int_distribution<size_t> pos_dist(0, tot_len);
+		Insertion insertion(doc.id(), operation_stamp++, doc.anchor(pos_dist(gen)), str);
+		doc.insert(insertion);
+		tot_len += str.size();
+	}
+	double insert_ms = elapsedMs(start);
+
+	size_t sink = 0;
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < numInsertions; ++i)
+	{
+		std::uniform_int_distribution<size_t> pos_dist(0, tot_len - 1);
+		sink += doc.anchor(pos_dist(gen)).pos;
+	}
+	double find_ms = elapsedMs(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	sink += doc.toString().size();
+	double export_ms = elapsedMs(start);
+	doNotOptimize(sink);
+
+	std::cout << "N " << (int)PieceN << " (order " << 2 * PieceN - 1 << "): insert " << insert_ms
+			  << "ms, find " << find_ms << "ms, toString " << export_ms << "ms\n";
+}
+
+int main(int argn, char **argv)
+{
+	int numInsertions = 1000000;
+	if (argn > 1)
+		numInsertions = std::atoi(argv[1]);
+
+	std::cout << "Running fanout sweep with " << numInsertions << " insertions, default N "
+			  << (int)defaultFanout<PieceInfo>() << "...\n";
+	fanoutBench<2>(numInsertions);
+	fanoutBench<4>(numInsertions);
+	fanoutBench<6>(numInsertions);
+	fanoutBench<8>(numInsertions);
+	fanoutBench<11>(numInsertions);
+	fanoutBench<16>(numInsertions);
+	fanoutBench<24>(numInsertions);
+	fanoutBench<32>(numInsertions);
+	fanoutBench<48>(numInsertions);
+	fanoutBench<64>(numInsertions);
+
+	return 0;
+}
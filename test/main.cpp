@@ -1,7 +1,9 @@
 ﻿#include <algorithm>
+#include <array>
 #include <cassert>
 #include <chrono>
 #include <iostream>
+#include <map>
 #include <random>
 #include <set>
 #include <sstream>
@@ -12,6 +14,7 @@
 
 #include "piecetree.hpp"
 #include "simpletext.hpp"
+#include "wire.hpp"
 
 std::string generateTestString(int index)
 {
@@ -156,7 +159,7 @@ void runInsertDeleteTest(int numOps, int minLen = 1, int maxLen = 20)
 		}
 
 		std::string expect = validator.toString();
-		bool match = (tree_content.str() == expect);
+		bool match = (tree_content.str() == expect) && doc.toString() == expect; // toString skips removed subtrees
 		std::cout << "Insert+Delete Test Content " << (match ? "matches" : "differs") << std::endl;
 		if (!match)
 		{
@@ -235,7 +238,7 @@ void runDeleteUndoRedoTest(int numOps = 200, int start_len = 5000)
 	{
 		std::string doc_str = build_doc_string();
 		std::string val_str = validator.toString();
-		bool match = (doc_str == val_str);
+		bool match = (doc_str == val_str) && doc.toString() == val_str;
 		std::cout << phase << " content " << (match ? "matches" : "differs") << "\n";
 		std::cout << "Doc size: " << doc.size()
 				  << ", Validator size: " << val_str.size() << "\n";
@@ -265,6 +268,7 @@ void runDeleteUndoRedoTest(int numOps = 200, int start_len = 5000)
 	check_equal("After redos");
 }
 
+template <typename Document = PieceCRDT>
 void runHistoryDeleteUndoRedoTest(int numOps = 200, int start_len = 5000)
 {
 	std::cout << "Running delete-undo-redo test...\n";
@@ -272,7 +276,7 @@ void runHistoryDeleteUndoRedoTest(int numOps = 200, int start_len = 5000)
 	std::random_device rd;
 	std::mt19937 gen(rd());
 
-	PieceCRDTValidator doc;
+	BasicPieceCRDTValidator<Document> doc;
 	uint32_t op_stamp = 1;
 
 	// 1. 插入长度为 5000 的初始文本
@@ -362,6 +366,900 @@ void coverTest()
 	doc.validate();
 }
 
+void bulkLoadTest(int numValues)
+{
+	std::mt19937 gen(numValues);
+	std::vector<std::string> values;
+	for (int i = 0; i < numValues; ++i)
+		values.push_back(generateRandomString(gen, 1, 5));
+
+	Sequence<size_t, std::string, 4> seq(values.begin(), values.end());
+	std::vector<int> numbers(numValues);
+	for (int i = 0; i < numValues; ++i)
+		numbers[i] = i * 2;
+	OrderedSet<int, 4> set(numbers.begin(), numbers.end());
+
+	// inserts after bulk load must split the packed leaves correctly
+	for (int i = 0; i < numValues / 2; ++i)
+	{
+		std::string str = generateRandomString(gen, 1, 5);
+		std::uniform_int_distribution<size_t> pos_dist(0, values.size());
+		size_t index = pos_dist(gen);
+		size_t pos = 0;
+		for (size_t k = 0; k < index; ++k)
+			pos += values[k].size();
+		seq.insertBefore(seq.find(pos), str);
+		values.insert(values.begin() + index, str);
+
+		int number = std::uniform_int_distribution<int>(0, 2 * numValues)(gen) | 1;
+		set.insert(number);
+		numbers.insert(std::lower_bound(numbers.begin(), numbers.end(), number), number);
+	}
+
+	bool match = seq.size() == values.size() && set.size() == numbers.size();
+	size_t index = 0, pos = 0;
+	for (auto it = seq.begin(); match && it != seq.end(); ++it, ++index)
+	{
+		match = *it == values[index] && it.position() == pos && seq.find(pos) == it;
+		pos += values[index].size();
+	}
+	index = 0;
+	for (auto it = set.begin(); match && it != set.end(); ++it, ++index)
+		match = *it == numbers[index];
+	std::cout << "Bulk load test with " << numValues << " values: content " << (match ? "matches" : "differs") << "\n";
+}
+
+void eraseTest(int numOps)
+{
+	std::mt19937 gen(numOps);
+	Sequence<size_t, std::string, 2> seq;
+	OrderedSet<int, 2> set;
+	std::vector<std::string> values;
+	std::vector<int> numbers;
+
+	bool match = true;
+	for (int i = 0; i < numOps && match; ++i)
+	{
+		// grow in the first half, shrink to empty in the second half
+		bool grow = i < numOps / 2 ? gen() % 3 != 0 : gen() % 3 == 0;
+		if (grow || values.empty())
+		{
+			std::string str = generateRandomString(gen, 1, 5);
+			size_t index = std::uniform_int_distribution<size_t>(0, values.size())(gen);
+			size_t pos = 0;
+			for (size_t k = 0; k < index; ++k)
+				pos += values[k].size();
+			seq.insertBefore(seq.find(pos), str);
+			values.insert(values.begin() + index, str);
+
+			int number = std::uniform_int_distribution<int>(0, numOps)(gen);
+			set.insert(number);
+			numbers.insert(std::lower_bound(numbers.begin(), numbers.end(), number), number);
+		}
+		else
+		{
+			size_t index = std::uniform_int_distribution<size_t>(0, values.size() - 1)(gen);
+			size_t pos = 0;
+			for (size_t k = 0; k < index; ++k)
+				pos += values[k].size();
+			auto next = seq.erase(seq.find(pos));
+			values.erase(values.begin() + index);
+			match = next.position() == pos && (index == values.size() ? next == seq.end() : *next == values[index]);
+
+			int number = numbers[std::uniform_int_distribution<size_t>(0, numbers.size() - 1)(gen)];
+			set.erase(set.find(number));
+			numbers.erase(std::lower_bound(numbers.begin(), numbers.end(), number));
+		}
+
+		if (i % 100 == 0 || i + 1 == numOps)
+		{
+			match = match && seq.size() == values.size() && set.size() == numbers.size();
+			size_t index = 0, pos = 0;
+			for (auto it = seq.begin(); match && index < values.size(); ++it, ++index)
+			{
+				match = *it == values[index] && it.position() == pos && seq.find(pos) == it;
+				pos += values[index].size();
+			}
+			index = 0;
+			for (auto it = set.begin(); match && index < numbers.size(); ++it, ++index)
+				match = *it == numbers[index];
+		}
+	}
+	std::cout << "Erase test with " << numOps << " operations: content " << (match ? "matches" : "differs")
+			  << ", " << seq.size() << " values left\n";
+}
+
+// deletions, then undo and redo of all of them, coalescing a few pieces after every operation
+template <typename Document = PieceCRDT>
+void coalesceTest(const char *name, int numOps, int start_len = 5000)
+{
+	std::mt19937 gen(numOps);
+	BasicPieceCRDTValidator<Document> doc;
+	uint32_t op_stamp = 1;
+	Insertion ins(doc.id(), op_stamp++, doc.anchor(0), generateRandomString(gen, start_len, start_len));
+	doc.insert(ins);
+
+	std::vector<uint32_t> deletion_stamps;
+	for (int i = 0; i < numOps; ++i)
+		deletion_stamps.push_back(op_stamp++);
+	std::shuffle(deletion_stamps.begin(), deletion_stamps.end(), gen);
+	for (uint32_t stamp : deletion_stamps)
+	{
+		size_t len = std::uniform_int_distribution<size_t>(10, 40)(gen);
+		size_t pos = std::uniform_int_distribution<size_t>(0, start_len - len)(gen);
+		Deletion del(doc.id(), stamp, doc.historyAnchor(pos), doc.historyAnchor(pos + len));
+		doc.del(del);
+		doc.coalesceStep(16);
+	}
+	bool valid = doc.validate();
+	size_t split_count = doc.pieceCount();
+
+	std::shuffle(deletion_stamps.begin(), deletion_stamps.end(), gen);
+	for (uint32_t target : deletion_stamps)
+	{
+		doc.undo(UndoOperation(doc.id(), op_stamp++, OperationID{doc.id(), target}));
+		doc.coalesceStep(16);
+	}
+	valid = doc.validate() && valid;
+
+	// with every deletion undone, the whole text is one piece again unless the tags are attached
+	doc.coalesce();
+	size_t merged_count = doc.pieceCount();
+	valid = doc.validate() && valid;
+	// attached tags pin every cut, only a RangeTree leaves the pieces free to merge
+	if constexpr (!std::is_same_v<Document, AttachedPieceCRDT>)
+		valid = merged_count < split_count && valid;
+
+	// redo has to cut the coalesced pieces at its tags again
+	std::shuffle(deletion_stamps.begin(), deletion_stamps.end(), gen);
+	for (uint32_t target : deletion_stamps)
+	{
+		doc.redo(RedoOperation(doc.id(), op_stamp++, OperationID{doc.id(), target}));
+		doc.coalesceStep(16);
+	}
+	valid = doc.validate() && valid;
+	std::cout << name << " coalesce test with " << numOps << " deletions: content " << (valid ? "matches" : "differs")
+			  << ", " << split_count << " pieces coalesced to " << merged_count << "\n";
+}
+
+// large deletions over a typed document cover whole subtrees lazily, undo has to push them down again
+template <typename Document = PieceCRDT>
+void coverRangeTest(const char *name, int numOps, int numInsertions = 5000)
+{
+	std::mt19937 gen(numOps);
+	BasicPieceCRDTValidator<Document> doc;
+	uint32_t op_stamp = 1;
+	size_t total_len = 0;
+	for (int i = 0; i < numInsertions; ++i)
+	{
+		std::string str = generateRandomString(gen, 1, 5);
+		size_t pos = std::uniform_int_distribution<size_t>(0, total_len)(gen);
+		Insertion ins(doc.id(), op_stamp++, doc.anchor(pos), str);
+		doc.insert(ins);
+		total_len += str.size();
+	}
+
+	std::vector<uint32_t> deletion_stamps;
+	for (int i = 0; i < numOps; ++i)
+		deletion_stamps.push_back(op_stamp++);
+	std::shuffle(deletion_stamps.begin(), deletion_stamps.end(), gen);
+	bool valid = true;
+	for (uint32_t stamp : deletion_stamps)
+	{
+		size_t len = std::uniform_int_distribution<size_t>(100, total_len / 4)(gen);
+		size_t pos = std::uniform_int_distribution<size_t>(0, total_len - len)(gen);
+		Deletion del(doc.id(), stamp, doc.historyAnchor(pos), doc.historyAnchor(pos + len));
+		doc.del(del);
+	}
+	valid = doc.validate() && valid;
+
+	std::shuffle(deletion_stamps.begin(), deletion_stamps.end(), gen);
+	for (uint32_t target : deletion_stamps)
+		doc.undo(UndoOperation(doc.id(), op_stamp++, OperationID{doc.id(), target}));
+	valid = doc.validate() && valid;
+
+	std::shuffle(deletion_stamps.begin(), deletion_stamps.end(), gen);
+	for (uint32_t target : deletion_stamps)
+		doc.redo(RedoOperation(doc.id(), op_stamp++, OperationID{doc.id(), target}));
+	valid = doc.validate() && valid;
+
+	// typing into removed text leaves visible pieces next to subtrees that are still covered lazily
+	for (int i = 0; i < numOps; ++i)
+	{
+		size_t len = std::uniform_int_distribution<size_t>(100, total_len / 4)(gen);
+		size_t pos = std::uniform_int_distribution<size_t>(0, total_len - len)(gen);
+		Deletion del(doc.id(), op_stamp++, doc.historyAnchor(pos), doc.historyAnchor(pos + len));
+		doc.del(del);
+	}
+	for (int i = 0; i < numOps; ++i)
+	{
+		std::string str = generateRandomString(gen, 1, 5);
+		size_t pos = std::uniform_int_distribution<size_t>(0, total_len - 1)(gen);
+		Insertion ins(doc.id(), op_stamp++, doc.historyAnchor(pos), str);
+		doc.insert(ins);
+		total_len += str.size();
+	}
+	std::string lazy = doc.toString(); // before begin() pushes every lazy tombstone down
+	doc.begin();
+	valid = lazy == doc.toString() && valid;
+
+	std::cout << name << " cover test with " << numOps << " deletions: content " << (valid ? "matches" : "differs")
+			  << "\n";
+}
+
+// one large paste edited all over, anchors into it are resolved by the piece index of the segment
+void pasteEditTest(int numEdits, size_t pasteLen = 50000)
+{
+	std::mt19937 gen(numEdits);
+	PieceCRDT doc;
+	uint32_t op_stamp = 1;
+	std::string expect = generateRandomString(gen, pasteLen, pasteLen);
+	Insertion paste(doc.id(), op_stamp++, doc.anchor(0), expect);
+	doc.insert(paste);
+	for (int i = 0; i < numEdits; ++i)
+	{
+		size_t pos = std::uniform_int_distribution<size_t>(0, expect.size() - 10)(gen);
+		if (i % 3 == 2)
+		{
+			Deletion del(doc.id(), op_stamp++, doc.anchor(pos), doc.anchor(pos + 5));
+			doc.del(del);
+			expect.erase(pos, 5);
+			continue;
+		}
+		std::string str = generateRandomString(gen, 1, 5);
+		Insertion ins(doc.id(), op_stamp++, doc.anchor(pos), str);
+		doc.insert(ins);
+		expect.insert(pos, str);
+	}
+	bool valid = doc.toString() == expect;
+	std::cout << "Paste edit test with " << numEdits << " edits: content " << (valid ? "matches" : "differs") << "\n";
+}
+
+// multi-byte text split inside and across checkpoints, the expected text is kept as code points
+void utf8Test(int numEdits)
+{
+	const std::vector<std::string> code_points = {"a", "\u00e9", "\u4e2d", "\U0001f600"};
+	std::mt19937 gen(numEdits);
+	PieceCRDT doc;
+	uint32_t op_stamp = 1;
+	std::vector<std::string> expect;
+	for (int i = 0; i < numEdits; ++i)
+	{
+		size_t pos = std::uniform_int_distribution<size_t>(0, expect.size())(gen);
+		if (i % 4 == 3 && pos + 3 < expect.size())
+		{
+			Deletion del(doc.id(), op_stamp++, doc.anchor(pos), doc.anchor(pos + 3));
+			doc.del(del);
+			expect.erase(expect.begin() + pos, expect.begin() + pos + 3);
+			continue;
+		}
+		std::vector<std::string> chars(std::uniform_int_distribution<size_t>(1, 200)(gen));
+		std::string str;
+		for (auto &c : chars)
+			str += c = code_points[std::uniform_int_distribution<size_t>(0, code_points.size() - 1)(gen)];
+		Insertion ins(doc.id(), op_stamp++, doc.anchor(pos), str);
+		doc.insert(ins);
+		expect.insert(expect.begin() + pos, chars.begin(), chars.end());
+	}
+	std::string expect_str;
+	for (const auto &c : expect)
+		expect_str += c;
+	bool valid = doc.toString() == expect_str && doc.size() == expect.size();
+	std::cout << "UTF-8 test with " << numEdits << " edits: content " << (valid ? "matches" : "differs") << "\n";
+}
+
+// long pastes are stored as chains of bounded pieces, edits and coalescing must keep every piece within the bound
+template <typename Document = PieceCRDT>
+void chunkTest(const char *name, int numEdits, size_t maxPieceLen = 16)
+{
+	const std::vector<std::string> code_points = {"a", "\u00e9", "\u4e2d", "\U0001f600"};
+	std::mt19937 gen(numEdits);
+	Document doc;
+	doc.setMaxPieceLength(maxPieceLen);
+	uint32_t op_stamp = 1;
+	std::vector<std::string> expect;
+	for (int i = 0; i < numEdits; ++i)
+	{
+		size_t pos = std::uniform_int_distribution<size_t>(0, expect.size())(gen);
+		if (i % 4 == 3 && pos + 20 < expect.size())
+		{
+			Deletion del(doc.id(), op_stamp++, doc.anchor(pos), doc.anchor(pos + 20));
+			doc.del(del);
+			expect.erase(expect.begin() + pos, expect.begin() + pos + 20);
+			continue;
+		}
+		// mostly typing, now and then a paste spanning many pieces
+		size_t len = i % 10 == 0 ? std::uniform_int_distribution<size_t>(1, 300)(gen)
+								 : std::uniform_int_distribution<size_t>(1, 5)(gen);
+		std::vector<std::string> chars(len);
+		std::string str;
+		for (auto &c : chars)
+			str += c = code_points[std::uniform_int_distribution<size_t>(0, code_points.size() - 1)(gen)];
+		Insertion ins(doc.id(), op_stamp++, doc.anchor(pos), str);
+		doc.insert(ins);
+		expect.insert(expect.begin() + pos, chars.begin(), chars.end());
+	}
+	std::string expect_str;
+	for (const auto &c : expect)
+		expect_str += c;
+	bool valid = doc.toString() == expect_str;
+
+	// removed pieces cut apart by the deletions merge again, but only up to the bound
+	size_t split_count = doc.pieceCount();
+	doc.coalesce();
+	size_t longest = 0;
+	for (auto it = doc.begin(); it != doc.end(); ++it)
+		longest = std::max(longest, it->len);
+	valid = doc.toString() == expect_str && longest <= maxPieceLen && valid;
+	std::cout << name << " chunk test with " << numEdits << " edits: content " << (valid ? "matches" : "differs")
+			  << ", " << split_count << " pieces coalesced to " << doc.pieceCount() << ", longest piece " << longest
+			  << "\n";
+}
+
+// one received batch applied as owned strings, as views copied into the arena and as views into the adopted
+// buffer, which the document has to keep alive once the caller drops it
+void ingestTest(int numOps)
+{
+	const std::vector<std::string> code_points = {"a", "\n", "\u00e9", "\u4e2d", "\U0001f600"};
+	std::mt19937 gen(numOps);
+	std::string received;
+	std::vector<std::pair<size_t, size_t>> texts; // offset and size in the buffer
+	std::vector<size_t> positions;
+	for (size_t i = 0, total_len = 0, cursor = 0; i < static_cast<size_t>(numOps); ++i)
+	{
+		size_t len = std::uniform_int_distribution<size_t>(1, 20)(gen);
+		size_t offset = received.size();
+		for (size_t k = 0; k < len; ++k)
+			received += code_points[std::uniform_int_distribution<size_t>(0, code_points.size() - 1)(gen)];
+		texts.emplace_back(offset, received.size() - offset);
+		// mostly typing on after the previous insertion, which is merged into its segment
+		if (i % 5 == 0)
+			cursor = std::uniform_int_distribution<size_t>(0, total_len)(gen);
+		positions.push_back(cursor);
+		cursor += len;
+		total_len += len;
+	}
+	auto buffer = std::shared_ptr<char[]>(new char[received.size()]);
+	memcpy(buffer.get(), received.data(), received.size());
+
+	PieceCRDT owned, copied, adopted;
+	for (size_t i = 0; i < texts.size(); ++i)
+	{
+		std::string_view text(buffer.get() + texts[i].first, texts[i].second);
+		uint32_t stamp = i + 1;
+		owned.insert(Insertion(owned.id(), stamp, owned.anchor(positions[i]), std::string(text)));
+		copied.insert(InsertionView(copied.id(), stamp, copied.anchor(positions[i]), text));
+		adopted.insert(InsertionView(adopted.id(), stamp, adopted.anchor(positions[i]), text), buffer);
+	}
+	std::weak_ptr<char[]> alive = buffer;
+	buffer.reset();
+	std::string expect = owned.toString();
+	bool valid = copied.toString() == expect && adopted.toString() == expect && !alive.expired();
+	std::cout << "Ingest test with " << numOps << " insertions: content " << (valid ? "matches" : "differs") << "\n";
+}
+
+// keystrokes at a few cursors are merged into the segments of earlier ones, anchors into the merged
+// text and undo of single keystrokes must still address their own characters.
+// undoing an insertion removes its text together with everything typed into it later
+void typingTest(int numKeys)
+{
+	std::mt19937 gen(numKeys);
+	const std::vector<std::string> code_points = {"a", "b", "c", "\u00e9", "\u4e2d"};
+	PieceCRDT doc;
+	std::vector<std::pair<std::string, uint32_t>> model; // every typed character with its stamp, in document order
+	size_t cursor = 0;
+	uint32_t op_stamp = 1;
+	for (int i = 0; i < numKeys; ++i)
+	{
+		// short runs, and long ones growing past the checkpoint step
+		if (i % (i < numKeys / 2 ? 20 : 150) == 0)
+			cursor = std::uniform_int_distribution<size_t>(0, model.size())(gen);
+		std::string str;
+		Anchor anchor = doc.anchor(cursor);
+		for (int k = 0; k < 1 + (i % 7 == 0); ++k)
+		{
+			const auto &c = code_points[std::uniform_int_distribution<size_t>(0, code_points.size() - 1)(gen)];
+			model.insert(model.begin() + cursor++, {c, op_stamp});
+			str += c;
+		}
+		doc.insert(Insertion(doc.id(), op_stamp++, anchor, str, doc.continuesTyping(doc.id(), anchor)));
+	}
+	std::vector<size_t> first(op_stamp, model.size()), last(op_stamp, 0);
+	for (size_t k = 0; k < model.size(); ++k)
+	{
+		first[model[k].second] = std::min(first[model[k].second], k);
+		last[model[k].second] = k;
+	}
+	std::vector<bool> undone(op_stamp, false);
+	auto expect = [&]
+	{
+		std::vector<int> covered(model.size() + 1, 0);
+		for (uint32_t stamp = 1; stamp < undone.size(); ++stamp)
+			if (undone[stamp])
+				++covered[first[stamp]], --covered[last[stamp] + 1];
+		std::string res;
+		for (size_t k = 0, depth = 0; k < model.size(); ++k)
+			if ((depth += covered[k]) == 0)
+				res += model[k].first;
+		return res;
+	};
+	bool valid = doc.toString() == expect();
+	size_t pieces = doc.pieceCount();
+
+	std::vector<uint32_t> stamps;
+	for (uint32_t stamp = 1; stamp < static_cast<uint32_t>(numKeys) + 1; ++stamp)
+		if (gen() % 4 == 0)
+			stamps.push_back(stamp);
+	for (uint32_t stamp : stamps)
+	{
+		doc.undo(UndoOperation(doc.id(), op_stamp++, OperationID{doc.id(), stamp}));
+		undone[stamp] = true;
+	}
+	valid = doc.toString() == expect() && valid;
+	std::shuffle(stamps.begin(), stamps.end(), gen);
+	stamps.resize(stamps.size() / 2);
+	for (uint32_t stamp : stamps)
+	{
+		doc.redo(RedoOperation(doc.id(), op_stamp++, OperationID{doc.id(), stamp}));
+		undone[stamp] = false;
+	}
+	valid = doc.toString() == expect() && valid;
+	std::cout << "Typing test with " << numKeys << " keystrokes: content " << (valid ? "matches" : "differs") << ", "
+			  << pieces << " pieces\n";
+}
+
+// replica A types "a" and then "b" before the same character while replica B inserts "c" there.
+// if A saw "c" before typing "b", "b" is its own segment and lands behind "c" like any newer insertion.
+// if not, A marks "b" as continuing "a" and the run stays together in front of "c" in every delivery
+// order. empty insertions undo and redo
+void typingOrderTest()
+{
+	std::array<uint8_t, 16> bytes{};
+	bytes[0] = 1;
+	ReplicaID a_id(bytes.begin(), bytes.end());
+	bytes[0] = 2;
+	ReplicaID b_id(bytes.begin(), bytes.end());
+	Anchor y{a_id, 1, 1};
+	Insertion a(a_id, 2, y, "a"), c(b_id, 3, y, "c"), empty(a_id, 5, y, "");
+	int mismatches = 0;
+	for (bool seen : {true, false})
+	{
+		PieceCRDT author;
+		author.insert(Insertion(a_id, 1, author.anchor(0), "xyz"));
+		author.insert(a);
+		if (seen)
+			author.insert(c);
+		Insertion b(a_id, 4, y, "b", author.continuesTyping(a_id, y));
+		mismatches += b.continues == seen;
+		std::string typed = seen ? "xacbyz" : "xabcyz";
+		std::vector<std::vector<const Insertion *>> orders = {{&a, &c, &b}, {&c, &a, &b}};
+		if (!seen)
+			orders.push_back({&a, &b, &c});
+		for (const auto &order : orders)
+		{
+			PieceCRDT doc;
+			doc.insert(Insertion(a_id, 1, doc.anchor(0), "xyz"));
+			for (const Insertion *op : order)
+				doc.insert(*op);
+			doc.insert(empty);
+			mismatches += doc.toString() != typed;
+			doc.undo(UndoOperation(a_id, 6, OperationID{a_id, 5}));
+			doc.undo(UndoOperation(a_id, 7, OperationID{a_id, 4}));
+			mismatches += doc.toString() != "xacyz";
+			doc.redo(RedoOperation(a_id, 8, OperationID{a_id, 5}));
+			doc.redo(RedoOperation(a_id, 9, OperationID{a_id, 4}));
+			mismatches += doc.toString() != typed;
+		}
+	}
+	std::cout << "Typing order test: " << mismatches << " mismatches\n";
+}
+
+// the ingest kernel against the scalar scan on random valid text, corrupted text and known bad sequences
+void utf8ScanTest(int numStrings)
+{
+	const std::vector<std::string> code_points = {"a", "\n", "\u00e9", "\u07ff", "\u0800", "\u4e2d", "\ud7ff", "\ue000",
+												  "\uffff", "\U00010000", "\U0001f600", "\U0010ffff"};
+	const std::vector<std::string> malformed = {"\x80", "\xbf", "\xc0\xaf", "\xc1\xbf", "\xe0\x80\xaf", "\xed\xa0\x80",
+												"\xed\xbf\xbf", "\xf0\x80\x80\xaf", "\xf4\x90\x80\x80", "\xf5\x80\x80\x80",
+												"\xff", "\xe4\xb8", "\xf0\x9f\x98", "\xc3", "\xc3\xa9\xa9"};
+	std::mt19937 gen(numStrings);
+	auto same = [](const Utf8Scan &a, const Utf8Scan &b)
+	{
+		return a.valid == b.valid && (!a.valid || (a.ascii == b.ascii && a.length == b.length && a.newlines == b.newlines));
+	};
+	// empty views of nothing come with a null pointer
+	Utf8Scan empty = utf8Scan(nullptr, 0);
+	int mismatches = !empty.valid || !empty.ascii || empty.length != 0 || empty.newlines != 0;
+	int rejected = 0;
+	for (int i = 0; i < numStrings; ++i)
+	{
+		std::string str;
+		size_t count = std::uniform_int_distribution<size_t>(0, 100)(gen);
+		for (size_t k = 0; k < count; ++k)
+			str += code_points[std::uniform_int_distribution<size_t>(0, i % 2 ? code_points.size() - 1 : 1)(gen)];
+		Utf8Scan scan = utf8Scan(str.data(), str.size());
+		mismatches += !same(scan, utf8ScanScalar(str.data(), str.size())) || !scan.valid || scan.length != count;
+		if (i % 3 == 0 && !str.empty())
+			str[std::uniform_int_distribution<size_t>(0, str.size() - 1)(gen)] ^= 1 << (gen() % 8);
+		else
+			str.insert(std::uniform_int_distribution<size_t>(0, str.size())(gen),
+					   malformed[std::uniform_int_distribution<size_t>(0, malformed.size() - 1)(gen)]);
+		scan = utf8Scan(str.data(), str.size());
+		mismatches += !same(scan, utf8ScanScalar(str.data(), str.size()));
+		rejected += !scan.valid;
+	}
+
+	PieceCRDT doc;
+	Insertion bad(doc.id(), 1, doc.anchor(0), "ab\xed\xa0\x80");
+	doc.insert(bad);
+	bool ignored = doc.size() == 0;
+	std::cout << "UTF-8 scan test with " << numStrings << " strings: " << mismatches << " mismatches, " << rejected
+			  << " of the corrupted ones rejected, malformed insertion " << (ignored ? "ignored" : "applied") << "\n";
+}
+
+// the piece index against a map: appended runs, inserts and erases all over, renaming values in place
+void chunkedIndexTest(int numOps)
+{
+	std::mt19937 gen(numOps);
+	ChunkedIndex<int, 8> index;
+	std::map<size_t, int> expect;
+	size_t key = 0;
+	for (int i = 0; i < numOps / 4; ++i)
+	{
+		key += std::uniform_int_distribution<size_t>(1, 20)(gen);
+		index.push_back(key, i);
+		expect[key] = i;
+	}
+	int mismatches = 0;
+	for (int i = 0; i < numOps; ++i)
+	{
+		size_t k = std::uniform_int_distribution<size_t>(0, key + 100)(gen);
+		auto it = expect.upper_bound(k);
+		if (i % 3 == 0 && expect.count(k) == 0)
+		{
+			index.insert(k, -i);
+			expect[k] = -i;
+		}
+		else if (it != expect.begin() && i % 3 == 1 && expect.size() > 1)
+		{
+			size_t erased = (--it)->first;
+			index.erase(erased);
+			expect.erase(erased);
+		}
+		else if (it != expect.begin())
+		{
+			index.replace(std::prev(it)->first, i);
+			std::prev(it)->second = i;
+		}
+		k = std::uniform_int_distribution<size_t>(expect.begin()->first, key + 100)(gen);
+		mismatches += index.floor(k) != std::prev(expect.upper_bound(k))->second;
+	}
+	auto it = expect.begin();
+	index.forEach([&](int value)
+	{
+		mismatches += it == expect.end() || (it++)->second != value;
+	});
+	mismatches += it != expect.end();
+	std::cout << "Chunked index test with " << numOps << " ops: " << mismatches << " mismatches\n";
+}
+
+// sparse stamps of many replicas against a map, then a document whose ops come from many replicas is undone
+// and redone through their tables
+void stampTableTest(int numStamps)
+{
+	std::mt19937 gen(numStamps);
+	StampTable<int> table;
+	std::map<uint32_t, int *> expect;
+	std::vector<int> values(numStamps);
+	uint32_t clock = 0;
+	for (int i = 0; i < numStamps; ++i)
+	{
+		clock += std::uniform_int_distribution<uint32_t>(1, i % 2 ? 3 : 500)(gen); // runs and gaps
+		table.set(clock, &values[i]);
+		expect[clock] = &values[i];
+	}
+	int mismatches = table.size() != expect.size();
+	for (int i = 0; i < numStamps; ++i)
+	{
+		uint32_t stamp = std::uniform_int_distribution<uint32_t>(0, clock + 5000)(gen);
+		auto it = expect.find(stamp);
+		mismatches += table.get(stamp) != (it == expect.end() ? nullptr : it->second);
+	}
+	auto it = expect.begin();
+	table.forEach([&](int *value)
+	{
+		mismatches += it == expect.end() || it++->second != value;
+	});
+	mismatches += it != expect.end();
+
+	PieceCRDT doc;
+	std::vector<ReplicaID> ids(100);
+	for (auto &id : ids)
+		id = uuids::uuid_system_generator{}();
+	std::vector<OperationID> inserts;
+	uint32_t operation_stamp = 1;
+	for (int i = 0; i < 2000; ++i)
+	{
+		const ReplicaID &id = ids[i % ids.size()];
+		Insertion insertion(id, operation_stamp++, doc.anchor(gen() % (doc.size() + 1)), "ab");
+		doc.insert(insertion);
+		inserts.push_back(OperationID{id, insertion.stamp});
+	}
+	for (auto &target : inserts)
+		doc.undo(UndoOperation(ids[0], operation_stamp++, target));
+	bool undone = doc.size() == 0;
+	for (auto &target : inserts)
+		doc.redo(RedoOperation(ids[0], operation_stamp++, target));
+	bool redone = doc.size() == 2 * inserts.size();
+	std::cout << "Stamp table test with " << numStamps << " stamps: " << mismatches << " mismatches, "
+			  << table.pageCount() << " pages, insertions of " << ids.size() << " replicas "
+			  << (undone && redone ? "undone and redone" : "differ") << "\n";
+}
+
+// ids of many replicas interned in random order get dense indices and are found again, cached or not
+void replicaTableTest(int numReplicas)
+{
+	std::mt19937 gen(numReplicas);
+	ReplicaTable table;
+	std::vector<ReplicaID> ids(numReplicas);
+	for (auto &id : ids)
+		id = uuids::uuid_system_generator{}();
+	int mismatches = 0;
+	for (int i = 0; i < numReplicas; ++i)
+	{
+		Replica *replica = table.intern(ids[i]);
+		mismatches += replica->index != uint32_t(i) || table[i] != replica || table.intern(ids[i]) != replica;
+	}
+	for (int i = 0; i < 10 * numReplicas; ++i)
+	{
+		size_t k = gen() % ids.size();
+		Replica *replica = table.find(ids[k]);
+		mismatches += replica == nullptr || replica->id != ids[k] || replica->index != k;
+	}
+	mismatches += table.find(uuids::uuid_system_generator{}()) != nullptr || table.size() != ids.size();
+	std::sort(ids.begin(), ids.end());
+	for (size_t k = 1; k < ids.size(); ++k)
+		mismatches += table.find(ids[k - 1])->rank >= table.find(ids[k])->rank;
+	std::cout << "Replica table test with " << numReplicas << " replicas: " << mismatches << " mismatches\n";
+}
+
+// replicas joining in the same gap over and over rank all replicas again, the order keys of the ops
+// stored so far must still sort like (stamp, ReplicaID)
+void orderKeyTest(int numReplicas)
+{
+	struct Document : PieceCRDT
+	{
+		size_t rerankCount() const { return this->replicas.rerankCount(); }
+		int misordered() const
+		{
+			std::vector<std::pair<const StoredOperation *, const ReplicaID *>> ops;
+			for (const auto &replica : this->replicas)
+				replica->segments.forEach([&](const Segment &seg)
+				{
+					ops.emplace_back(&seg, &replica->id);
+				});
+			std::sort(ops.begin(), ops.end(), [](const auto &a, const auto &b)
+			{
+				return *a.first < *b.first;
+			});
+			int count = 0;
+			for (size_t k = 1; k < ops.size(); ++k)
+				count += std::make_pair(ops[k - 1].first->stamp(), *ops[k - 1].second) >=
+						 std::make_pair(ops[k].first->stamp(), *ops[k].second);
+			return count;
+		}
+	};
+	std::mt19937 gen(numReplicas);
+	Document doc;
+	uint32_t operation_stamp = 1;
+	std::array<uint8_t, 16> bytes{};
+	for (int i = 0; i < numReplicas; ++i)
+	{
+		bytes[0] = 0x80; // each id is just above 80..., below the one before it
+		for (int k = 1; k < 16; ++k)
+			bytes[k] = k == 1 + i / 256 ? uint8_t(255 - i % 256) : 0;
+		ReplicaID id(bytes.begin(), bytes.end());
+		for (int k = 0; k < 3; ++k) // ops of different replicas share stamps
+		{
+			Insertion insertion(id, operation_stamp + k, doc.anchor(gen() % (doc.size() + 1)), "ab");
+			doc.insert(insertion);
+		}
+		operation_stamp += i % 2 ? 3 : 0;
+	}
+	std::cout << "Order key test with " << numReplicas << " replicas: " << doc.rerankCount() << " reranks, "
+			  << doc.misordered() << " misordered ops\n";
+}
+
+// objects keep their address while the arena grows, are visited in creation order and destroyed once
+void objectArenaTest(int numObjects)
+{
+	struct Counted
+	{
+		int value;
+		int *live;
+		Counted(int value, int *live) : value(value), live(live) { ++*live; }
+		~Counted() { --*live; }
+	};
+	int live = 0, mismatches = 0;
+	size_t chunks = 0;
+	{
+		ObjectArena<Counted> arena;
+		std::vector<Counted *> created;
+		for (int i = 0; i < numObjects; ++i)
+			created.push_back(arena.create(i, &live));
+		for (int i = 0; i < numObjects; ++i)
+			mismatches += created[i]->value != i;
+		int next = 0;
+		arena.forEach([&](const Counted &object)
+		{
+			mismatches += &object != created[next] || object.value != next;
+			++next;
+		});
+		mismatches += next != numObjects || live != numObjects || arena.size() != size_t(numObjects);
+		ObjectArena<Counted> moved(std::move(arena));
+		mismatches += moved.size() != size_t(numObjects) || arena.size() != 0;
+		chunks = moved.chunkCount();
+	}
+	std::cout << "Object arena test with " << numObjects << " objects: " << mismatches << " mismatches, " << chunks
+			  << " chunks, " << live << " left alive\n";
+}
+
+// random ops of a few replicas in batches of random size decode to the same ops, with the inserted text
+// viewed inside the batch, and encode to the same bytes again. every truncated batch is rejected
+void wireTest(int numOps)
+{
+	std::mt19937 gen(numOps);
+	std::vector<ReplicaID> ids(5);
+	for (auto &id : ids)
+		id = uuids::uuid_system_generator{}();
+	const std::vector<std::string> texts = {"", "a", "hello", "\u00e9t\u00e9", "\U0001f600 line\n", std::string(300, 'x')};
+	auto randomAnchor = [&](uint32_t stamp)
+	{
+		Anchor anchor;
+		anchor.replica = ids[gen() % ids.size()];
+		anchor.stamp = stamp - std::min<uint32_t>(stamp, gen() % 1000);
+		anchor.pos = gen() % 3 ? gen() % 100 : gen();
+		return anchor;
+	};
+	auto same = [](const Anchor &a, const Anchor &b)
+	{
+		return a.replica == b.replica && a.stamp == b.stamp && a.pos == b.pos;
+	};
+	int mismatches = 0, rejected = 0, truncations = 0, batches = 0;
+	uint32_t stamp = 1;
+	for (int done = 0; done < numOps; ++batches)
+	{
+		std::vector<Insertion> insertions;
+		std::vector<Deletion> deletions;
+		std::vector<std::tuple<ReplicaID, uint32_t, OperationID>> targets; // of undos and redos
+		std::vector<OperationType> order;
+		WireEncoder encoder;
+		int size = std::uniform_int_distribution<int>(0, 200)(gen);
+		for (int i = 0; i < size; ++i, ++done)
+		{
+			const ReplicaID &replica = ids[gen() % ids.size()];
+			stamp += gen() % 4; // stamps of different replicas may tie
+			auto type = static_cast<OperationType>(std::vector<int>{0, 0, 0, 1, 1, 3, 4}[gen() % 7]);
+			order.push_back(type);
+			if (type == OperationType::Insert)
+				encoder.add(insertions.emplace_back(replica, stamp, randomAnchor(stamp), texts[gen() % texts.size()], gen() % 2));
+			else if (type == OperationType::Delete)
+			{
+				Anchor begin = randomAnchor(stamp), end = gen() % 2 ? begin : randomAnchor(stamp);
+				end.pos = gen() % 2 ? begin.pos + gen() % 50 : end.pos;
+				encoder.add(deletions.emplace_back(replica, stamp, begin, end));
+			}
+			else
+			{
+				OperationID target{ids[gen() % ids.size()], static_cast<uint32_t>(stamp - gen() % 100)};
+				targets.emplace_back(replica, stamp, target);
+				if (type == OperationType::Undo)
+					encoder.add(UndoOperation(replica, stamp, target));
+				else
+					encoder.add(RedoOperation(replica, stamp, target));
+			}
+		}
+		std::string batch = encoder.finish();
+
+		size_t next = 0, insertion = 0, deletion = 0, target = 0;
+		WireEncoder reencoder;
+		WireDecoder decoder(batch);
+		bool valid = decoder.decode([&](const auto &op)
+		{
+			using T = std::decay_t<decltype(op)>;
+			mismatches += next >= order.size() || order[next++] != op.type;
+			reencoder.add(op);
+			if constexpr (std::is_same_v<T, InsertionView>)
+			{
+				const Insertion &expect = insertions[insertion++];
+				mismatches += op.replica != expect.replica || op.stamp != expect.stamp || !same(op.anchor, expect.anchor) ||
+							  op.str != expect.str || op.continues != expect.continues || op.str.data() < batch.data() ||
+							  op.str.data() + op.str.size() > batch.data() + batch.size();
+			}
+			else if constexpr (std::is_same_v<T, Deletion>)
+			{
+				const Deletion &expect = deletions[deletion++];
+				mismatches += op.replica != expect.replica || op.stamp != expect.stamp || !same(op.begin, expect.begin) ||
+							  !same(op.end, expect.end);
+			}
+			else
+			{
+				auto &[replica, op_stamp, expect] = targets[target++];
+				mismatches += op.replica != replica || op.stamp != op_stamp || op.target != expect;
+			}
+		});
+		mismatches += !valid || next != order.size() || reencoder.finish() != batch;
+
+		for (size_t len = 0; len < batch.size(); len += 1 + batch.size() / 50)
+		{
+			WireDecoder truncated(std::string_view(batch.data(), len));
+			rejected += !truncated.decode([](const auto &) {});
+			++truncations;
+		}
+		if (!batch.empty()) // corrupted batches must be read safely, whatever they decode to
+		{
+			batch[gen() % batch.size()] ^= 1 << (gen() % 8);
+			WireDecoder corrupted(batch);
+			corrupted.decode([](const auto &) {});
+		}
+	}
+
+	// words typed one after another arrive in one batch, the document references them in the batch
+	PieceCRDT doc;
+	WireEncoder encoder;
+	std::string expect;
+	Anchor anchor = doc.anchor(0); // typing keeps inserting before the end of the document
+	for (uint32_t k = 1; k <= 100; ++k)
+	{
+		std::string word = texts[1 + gen() % (texts.size() - 1)];
+		encoder.add(Insertion(doc.id(), k, anchor, word));
+		expect += word;
+	}
+	std::string batch = encoder.finish();
+	std::shared_ptr<const char[]> buffer(new char[batch.size()]);
+	memcpy(const_cast<char *>(buffer.get()), batch.data(), batch.size());
+	WireDecoder decoder(std::string_view(buffer.get(), batch.size()));
+	decoder.decode([&](const auto &op)
+	{
+		if constexpr (std::is_same_v<std::decay_t<decltype(op)>, InsertionView>)
+			doc.insert(op, buffer);
+	});
+	bool applied = doc.toString() == expect;
+	std::cout << "Wire test with " << numOps << " ops in " << batches << " batches: " << mismatches << " mismatches, "
+			  << rejected << " of " << truncations << " truncated batches rejected, typed batch "
+			  << (applied ? "matches" : "differs") << "\n";
+}
+
+// two replicas taking turns at a few cursors exhaust the label gaps quickly. the turns keep their
+// keystrokes in separate pieces, labels must stay increasing after relabelling
+void labelTest(int numInsertions)
+{
+	struct Document : PieceCRDT
+	{
+		size_t relabelCount() const { return this->piece_tree.relabelCount(); }
+	};
+	std::mt19937 gen(numInsertions);
+	Document doc;
+	ReplicaID ids[2] = {doc.id(), uuids::uuid_system_generator{}()};
+	size_t tot_len = 0, cursor = 0;
+	uint32_t operation_stamp = 1;
+	for (int i = 0; i < numInsertions; ++i)
+	{
+		if (i % 1000 == 0)
+			cursor = std::uniform_int_distribution<size_t>(0, tot_len)(gen);
+		Anchor anchor = doc.anchor(cursor);
+		Insertion insertion(ids[i % 2], operation_stamp++, anchor, "x", doc.continuesTyping(ids[i % 2], anchor));
+		doc.insert(insertion);
+		++tot_len;
+		++cursor;
+	}
+	bool ordered = doc.pieceCount() > size_t(numInsertions) && doc.relabelCount() > 0;
+	for (auto it = doc.begin(), next = ++doc.begin(); ordered && next != doc.end(); ++it, ++next)
+		ordered = it->label < next->label;
+	std::cout << "Label test with " << numInsertions << " insertions: labels " << (ordered ? "ordered" : "unordered")
+			  << " after " << doc.relabelCount() << " relabels\n";
+}
+
 void speedTest(int numInsertions, int minLen = 1, int maxLen = 20)
 {
 	std::random_device rd;
@@ -514,7 +1412,32 @@ int main(int argn, char **argv)
 	// coverTest();
 	// runInsertDeleteTest(1000, 30, 40);
 	// runDeleteUndoRedoTest(200, 5000);
+	bulkLoadTest(1);
+	bulkLoadTest(7);
+	bulkLoadTest(100);
+	bulkLoadTest(10000);
+	eraseTest(20000);
+	coalesceTest<PieceCRDT>("RangeTree", 100);
+	coalesceTest<AttachedPieceCRDT>("BoundaryTags", 100);
+	labelTest(100000);
+	coverRangeTest<PieceCRDT>("RangeTree", 50);
+	coverRangeTest<AttachedPieceCRDT>("BoundaryTags", 50);
+	pasteEditTest(10000);
+	utf8Test(2000);
+	chunkTest<PieceCRDT>("RangeTree", 2000);
+	chunkTest<AttachedPieceCRDT>("BoundaryTags", 2000);
+	ingestTest(5000);
+	typingTest(5000);
+	typingOrderTest();
+	utf8ScanTest(100000);
+	chunkedIndexTest(100000);
+	stampTableTest(100000);
+	objectArenaTest(10000);
+	replicaTableTest(1000);
+	orderKeyTest(200);
+	wireTest(20000);
 	runHistoryDeleteUndoRedoTest(100, 5000);
+	runHistoryDeleteUndoRedoTest<AttachedPieceCRDT>(100, 5000);
 	// int numInsertions = 5000; // 默认插入次数
 	// if (argn > 1)
 	// {
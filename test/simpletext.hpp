@@ -163,11 +163,19 @@ public:
 	}
 };
 
-class PieceCRDTValidator : public PieceCRDT
+template <typename Document = PieceCRDT>
+class BasicPieceCRDTValidator : public Document
 {
 public:
+	using Document::begin;
+	using Document::end;
+	using Document::size;
+	using Document::toString;
+
 	bool validate()
 	{
+		auto &replicas = this->replicas;
+		auto &piece_tree = this->piece_tree;
 		std::string total_str;
 		std::vector<int> delete_count;
 		size_t total_size = (--end()).position().total;
@@ -181,27 +189,24 @@ public:
 		//
 		for (const auto &replica : replicas)
 		{
-			for (const auto &op : replica.segments)
+			replica->deletions.forEach([&](const StoredDeletion &del)
 			{
-				if (op && op->type == OperationType::Delete)
-				{
-					auto *del = static_cast<StoredDeletion *>(op.get());
-					// 如果删除操作已被撤销，则不计入
-					if (del->has_undo)
-						continue;
+				// 如果删除操作已被撤销，则不计入
+				if (del.has_undo)
+					return;
 
-					auto &left = del->left->anchor;
-					auto &right = del->right->anchor;
+				auto &left = del.left->anchor;
+				auto &right = del.right->anchor;
 
-					size_t start = piece_tree.find(left).position().total;
-					size_t end = piece_tree.find(right).position().total;
+				// anchors may lie inside coalesced pieces
+				size_t start = piece_tree.historyOffset(left);
+				size_t end = piece_tree.historyOffset(right);
 
-					for (size_t k = start; k < end; ++k)
-					{
-						delete_count[k]++;
-					}
+				for (size_t k = start; k < end; ++k)
+				{
+					delete_count[k]++;
 				}
-			}
+			});
 		}
 
 		std::string reconstructed;
@@ -221,4 +226,6 @@ public:
 		// std::cout << "PieceCRDTValidator: actual content \"" << toString() << "\"\n";
 		return valid;
 	}
-};
\ No newline at end of file
+};
+
+using PieceCRDTValidator = BasicPieceCRDTValidator<>;